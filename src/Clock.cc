@@ -0,0 +1,67 @@
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "Clock.h"
+
+using namespace plugin::ESnet_Zeek_Exporter;
+
+bool Clock::ParseSource(const char* name, Source& source)
+{
+    if ( strcmp(name, "steady_clock") == 0 )
+        source = STEADY_CLOCK;
+    else if ( strcmp(name, "tsc") == 0 )
+        source = TSC;
+    else
+        return false;
+
+    return true;
+}
+
+bool Clock::HaveCycleCounter()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // We need the invariant TSC, which ticks at a constant rate regardless of frequency scaling and sleep states.
+    unsigned int eax, ebx, ecx, edx;
+    if ( ! __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) )
+        return false;
+
+    return edx & (1 << 8);
+#elif defined(__aarch64__)
+    // The generic timer's virtual count is always available, and fixed frequency.
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Clock::Init(Source new_source)
+{
+    source = STEADY_CLOCK;
+    microseconds_per_tick = 0.001;
+
+    if ( new_source == STEADY_CLOCK )
+        return true;
+
+    if ( ! HaveCycleCounter() )
+        return false;
+
+    // Calibrate the cycle counter against steady_clock. 20ms keeps the error well below a percent, without
+    // noticeably delaying startup.
+    auto calibration_start = std::chrono::steady_clock::now();
+    uint64_t ticks_start = ReadCycleCounter();
+    auto calibration_stop = calibration_start;
+
+    while ( calibration_stop - calibration_start < std::chrono::milliseconds(20) )
+        calibration_stop = std::chrono::steady_clock::now();
+
+    uint64_t ticks = ReadCycleCounter() - ticks_start;
+    if ( ! ticks )
+        return false;
+
+    microseconds_per_tick = std::chrono::duration<double, std::micro>(calibration_stop - calibration_start).count() / ticks;
+    source = new_source;
+    return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace plugin {
+    namespace ESnet_Zeek_Exporter {
+
+        // The timestamps we use to measure durations. By default these come from std::chrono::steady_clock, but reading the
+        // CPU's cycle counter directly is much cheaper, especially on VMs where the vDSO clock falls back to a syscall.
+        class Clock
+        {
+        public:
+            enum Source { STEADY_CLOCK, TSC };
+
+            // Parses a source name, as used by Exporter::timing_source. Returns false if it isn't one we know.
+            static bool ParseSource(const char* name, Source& source);
+
+            // Selects the source, calibrating the cycle counter against steady_clock if needed. Returns false if the
+            // source isn't usable on this system, in which case we keep using steady_clock.
+            bool Init(Source source);
+
+            Source GetSource() const { return source; }
+
+            // The current time, in ticks of the selected source.
+            uint64_t Now() const
+            {
+                if ( source == TSC )
+                    return ReadCycleCounter();
+
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+
+            // Converts a difference between two Now() values to microseconds.
+            double Microseconds(uint64_t ticks) const
+            {
+                return ticks * microseconds_per_tick;
+            }
+
+        private:
+            static bool HaveCycleCounter();
+
+            static uint64_t ReadCycleCounter()
+            {
+#if defined(__x86_64__) || defined(__i386__)
+                // rdtscp waits for prior instructions to finish, so the measured code can't leak past the timestamp.
+                unsigned int aux;
+                return __rdtscp(&aux);
+#elif defined(__aarch64__)
+                uint64_t ticks;
+                asm volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks) :: "memory");
+                return ticks;
+#else
+                return 0;
+#endif
+            }
+
+            Source source = STEADY_CLOCK;
+            double microseconds_per_tick = 0.001;
+        };
+
+    }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace plugin {
+    namespace ESnet_Zeek_Exporter {
+
+        // Finds the keys with the most weight in a stream, in fixed memory, with the Space-Saving algorithm. We keep
+        // capacity counters, and a key without one takes over the smallest, inheriting its weight (which is then the
+        // most it can be overcounted by). Any key with more than 1/capacity of the total weight is guaranteed to have
+        // a counter.
+        //
+        // The counters are a min-heap, so the smallest is always at the front, and an update is O(log capacity).
+        class HeavyHitters
+        {
+        public:
+            struct Entry
+            {
+                uint64_t key;
+                double weight;
+                double error;
+            };
+
+            void SetCapacity(size_t arg_capacity)
+            {
+                capacity = arg_capacity;
+                heap.reserve(capacity);
+                positions.reserve(capacity);
+            }
+
+            void Add(uint64_t key, double weight)
+            {
+                auto it = positions.find(key);
+                if ( it != positions.end() )
+                {
+                    heap[it->second].weight += weight;
+                    SiftDown(it->second);
+                    return;
+                }
+
+                if ( heap.size() < capacity )
+                {
+                    heap.push_back({key, weight, 0.0});
+                    positions.emplace(key, heap.size() - 1);
+                    SiftUp(heap.size() - 1);
+                    return;
+                }
+
+                if ( heap.empty() )
+                    return;
+
+                // Take over the smallest counter.
+                positions.erase(heap[0].key);
+                double smallest = heap[0].weight;
+                heap[0] = {key, smallest + weight, smallest};
+                positions.emplace(key, 0);
+                SiftDown(0);
+            }
+
+            // The count entries with the most weight they're guaranteed to have (their weight, less their error),
+            // heaviest first. Ranking by the weight alone would favor keys that just took over a heavy counter.
+            std::vector<Entry> Top(size_t count) const
+            {
+                std::vector<Entry> top = heap;
+                count = std::min(count, top.size());
+                std::partial_sort(top.begin(), top.begin() + count, top.end(),
+                                  [](const Entry& a, const Entry& b) { return a.weight - a.error > b.weight - b.error; });
+                top.resize(count);
+                return top;
+            }
+
+            // Scales every counter by factor, so that older weight counts for less. Every counter shrinks by the
+            // same factor, so the heap stays in order.
+            void Decay(double factor)
+            {
+                for ( auto& entry : heap )
+                {
+                    entry.weight *= factor;
+                    entry.error *= factor;
+                }
+            }
+
+        private:
+            void Swap(size_t a, size_t b)
+            {
+                std::swap(heap[a], heap[b]);
+                positions[heap[a].key] = a;
+                positions[heap[b].key] = b;
+            }
+
+            void SiftUp(size_t i)
+            {
+                while ( i > 0 && heap[i].weight < heap[(i - 1) / 2].weight )
+                {
+                    Swap(i, (i - 1) / 2);
+                    i = (i - 1) / 2;
+                }
+            }
+
+            void SiftDown(size_t i)
+            {
+                while ( true )
+                {
+                    size_t smallest = i;
+                    size_t left = 2 * i + 1;
+                    size_t right = left + 1;
+
+                    if ( left < heap.size() && heap[left].weight < heap[smallest].weight )
+                        smallest = left;
+                    if ( right < heap.size() && heap[right].weight < heap[smallest].weight )
+                        smallest = right;
+
+                    if ( smallest == i )
+                        return;
+
+                    Swap(i, smallest);
+                    i = smallest;
+                }
+            }
+
+            size_t capacity = 0;
+            std::vector<Entry> heap;
+            std::unordered_map<uint64_t, size_t> positions;
+        };
+
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace plugin {
+    namespace ESnet_Zeek_Exporter {
+
+        // A fixed, log-linear bucket layout for function durations. Each power of two (in nanoseconds) is split into
+        // 2^sub_bucket_bits linear sub-buckets, so finding a value's bucket is a count-leading-zeros and a few shifts,
+        // rather than prometheus::Histogram's search through its boundaries.
+        //
+        // Bucket 0 holds everything below 2^min_exponent ns (~1us), and the last bucket everything at or above
+        // 2^(min_exponent + num_octaves) ns (~4.3s).
+        class LatencyBuckets
+        {
+        public:
+            static constexpr int min_exponent = 10;
+            static constexpr int num_octaves = 22;
+            static constexpr int sub_bucket_bits = 1;
+            static constexpr size_t num_buckets = (num_octaves << sub_bucket_bits) + 2;
+
+            static size_t Index(uint64_t nanoseconds)
+            {
+                if ( nanoseconds < (uint64_t(1) << min_exponent) )
+                    return 0;
+
+                int exponent = 63 - __builtin_clzll(nanoseconds);
+                if ( exponent >= min_exponent + num_octaves )
+                    return num_buckets - 1;
+
+                size_t sub_bucket = (nanoseconds >> (exponent - sub_bucket_bits)) & ((1 << sub_bucket_bits) - 1);
+                return 1 + ((exponent - min_exponent) << sub_bucket_bits) + sub_bucket;
+            }
+
+            // The upper bounds of each bucket, in seconds, for prometheus::Histogram. This leaves out the last
+            // bucket, which Prometheus handles as +Inf.
+            static std::vector<double> Boundaries()
+            {
+                std::vector<double> boundaries;
+                boundaries.push_back((uint64_t(1) << min_exponent) / 1e9);
+
+                for ( int octave = 0; octave < num_octaves; ++octave )
+                {
+                    double base = uint64_t(1) << (min_exponent + octave);
+                    for ( int sub_bucket = 1; sub_bucket <= (1 << sub_bucket_bits); ++sub_bucket )
+                        boundaries.push_back(base * (1 + sub_bucket / double(1 << sub_bucket_bits)) / 1e9);
+                }
+
+                return boundaries;
+            }
+        };
+
+        // Power-of-two buckets for counts, from 1 to 2^max_exponent.
+        class CountBuckets
+        {
+        public:
+            static constexpr int max_exponent = 16;
+            static constexpr size_t num_buckets = max_exponent + 2;
+
+            static size_t Index(uint64_t count)
+            {
+                if ( count <= 1 )
+                    return 0;
+
+                size_t index = 64 - __builtin_clzll(count - 1);
+                return index < num_buckets ? index : num_buckets - 1;
+            }
+
+            static std::vector<double> Boundaries()
+            {
+                std::vector<double> boundaries;
+                for ( int exponent = 0; exponent <= max_exponent; ++exponent )
+                    boundaries.push_back(uint64_t(1) << exponent);
+
+                return boundaries;
+            }
+        };
+
+    }
+}
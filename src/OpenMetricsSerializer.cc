@@ -0,0 +1,209 @@
+#include <cmath>
+#include <limits>
+#include <sstream>
+
+#include "OpenMetricsSerializer.h"
+
+using namespace plugin::ESnet_Zeek_Exporter;
+
+static void WriteValue(std::ostream& out, double value)
+{
+    if ( std::isnan(value) )
+        out << "NaN";
+    else if ( std::isinf(value) )
+        out << ( value < 0 ? "-Inf" : "+Inf" );
+    else
+        out << value;
+}
+
+static void WriteEscaped(std::ostream& out, const std::string& value, bool quotes)
+{
+    for ( char c : value )
+    {
+        if ( c == '\\' )
+            out << "\\\\";
+        else if ( c == '\n' )
+            out << "\\n";
+        else if ( c == '"' && quotes )
+            out << "\\\"";
+        else
+            out << c;
+    }
+}
+
+static void WriteLabels(std::ostream& out, const prometheus::ClientMetric& metric, const char* extra_name = nullptr, double extra_value = 0.0)
+{
+    if ( metric.label.empty() && ! extra_name )
+        return;
+
+    out << '{';
+    const char* separator = "";
+    for ( const auto& label : metric.label )
+    {
+        out << separator << label.name << "=\"";
+        WriteEscaped(out, label.value, true);
+        out << '"';
+        separator = ",";
+    }
+
+    if ( extra_name )
+    {
+        out << separator << extra_name << "=\"";
+        WriteValue(out, extra_value);
+        out << '"';
+    }
+
+    out << '}';
+}
+
+static const Exemplar* FindExemplar(const std::unordered_map<std::string, Exemplar>* family_exemplars,
+                                    const prometheus::ClientMetric& metric)
+{
+    if ( ! family_exemplars )
+        return nullptr;
+
+    std::map<std::string, std::string> labels;
+    for ( const auto& label : metric.label )
+        labels.emplace(label.name, label.value);
+
+    auto it = family_exemplars->find(OpenMetricsSerializer::LabelKey(labels));
+    return it != family_exemplars->end() ? &it->second : nullptr;
+}
+
+std::string OpenMetricsSerializer::Serialize(const std::vector<prometheus::MetricFamily>& families, const ExemplarMap* exemplars) const
+{
+    std::ostringstream out;
+    out.imbue(std::locale::classic());
+    out.precision(std::numeric_limits<double>::max_digits10 - 1);
+
+    for ( const auto& family : families )
+    {
+        // OpenMetrics counters are named without the _total, which only their samples have, and which they must have.
+        // So a counter family whose name doesn't end in _total, e.g. zeek_cpu_time_per_function_seconds, has samples
+        // named zeek_cpu_time_per_function_seconds_total here, and that's what Prometheus stores them as. The README
+        // points this out, next to Exporter::exemplars.
+        std::string name = family.name;
+        if ( family.type == prometheus::MetricType::Counter && name.size() > 6 && name.compare(name.size() - 6, 6, "_total") == 0 )
+            name.resize(name.size() - 6);
+
+        const char* type;
+        switch ( family.type )
+        {
+            case prometheus::MetricType::Counter:
+                type = "counter";
+                break;
+            case prometheus::MetricType::Gauge:
+                type = "gauge";
+                break;
+            case prometheus::MetricType::Histogram:
+                type = "histogram";
+                break;
+            default:
+                // We don't register anything else.
+                type = "unknown";
+                break;
+        }
+
+        out << "# TYPE " << name << ' ' << type << '\n';
+        out << "# HELP " << name << ' ';
+        WriteEscaped(out, family.help, false);
+        out << '\n';
+
+        const std::unordered_map<std::string, Exemplar>* family_exemplars = nullptr;
+        if ( exemplars )
+        {
+            auto it = exemplars->find(family.name);
+            if ( it != exemplars->end() )
+                family_exemplars = &it->second;
+        }
+
+        for ( const auto& metric : family.metric )
+        {
+            switch ( family.type )
+            {
+                case prometheus::MetricType::Counter:
+                {
+                    out << name << "_total";
+                    WriteLabels(out, metric);
+                    out << ' ';
+                    WriteValue(out, metric.counter.value);
+
+                    if ( const Exemplar* exemplar = FindExemplar(family_exemplars, metric) )
+                    {
+                        out << " # {" << exemplar->labels << "} ";
+                        WriteValue(out, exemplar->value);
+                        out << ' ' << std::fixed << exemplar->timestamp << std::defaultfloat;
+                    }
+
+                    out << '\n';
+                    break;
+                }
+
+                case prometheus::MetricType::Gauge:
+                    out << name;
+                    WriteLabels(out, metric);
+                    out << ' ';
+                    WriteValue(out, metric.gauge.value);
+                    out << '\n';
+                    break;
+
+                case prometheus::MetricType::Histogram:
+                {
+                    for ( const auto& bucket : metric.histogram.bucket )
+                    {
+                        out << name << "_bucket";
+                        WriteLabels(out, metric, "le", bucket.upper_bound);
+                        out << ' ' << bucket.cumulative_count << '\n';
+                    }
+
+                    // prometheus-cpp leaves out the +Inf bucket, but OpenMetrics requires it.
+                    if ( metric.histogram.bucket.empty() || ! std::isinf(metric.histogram.bucket.back().upper_bound) )
+                    {
+                        out << name << "_bucket";
+                        WriteLabels(out, metric, "le", std::numeric_limits<double>::infinity());
+                        out << ' ' << metric.histogram.sample_count << '\n';
+                    }
+
+                    out << name << "_count";
+                    WriteLabels(out, metric);
+                    out << ' ' << metric.histogram.sample_count << '\n';
+
+                    out << name << "_sum";
+                    WriteLabels(out, metric);
+                    out << ' ';
+                    WriteValue(out, metric.histogram.sample_sum);
+                    out << '\n';
+                    break;
+                }
+
+                default:
+                    out << name;
+                    WriteLabels(out, metric);
+                    out << ' ';
+                    WriteValue(out, metric.untyped.value);
+                    out << '\n';
+                    break;
+            }
+        }
+    }
+
+    out << "# EOF\n";
+    return out.str();
+}
+
+std::string OpenMetricsSerializer::LabelKey(const std::map<std::string, std::string>& labels)
+{
+    // Label names can't contain '=', and the values are escaped, so separating them with '=' and '\n' is unambiguous.
+    std::string key;
+    for ( const auto& label : labels )
+        key += label.first + "=" + EscapeLabelValue(label.second) + "\n";
+
+    return key;
+}
+
+std::string OpenMetricsSerializer::EscapeLabelValue(const std::string& value)
+{
+    std::ostringstream out;
+    WriteEscaped(out, value, true);
+    return out.str();
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <prometheus/metric_family.h>
+
+namespace plugin {
+    namespace ESnet_Zeek_Exporter {
+
+        // An OpenMetrics exemplar, i.e. one observation behind a counter's value. We use these for the slowest call
+        // to each function in an interval.
+        struct Exemplar
+        {
+            // Already rendered, e.g. uid="CHhAvVGS1DHFjwGM9", or empty.
+            std::string labels;
+            double value;
+            // In seconds since the epoch.
+            double timestamp;
+        };
+
+        // Exemplars by family name, and then by their series' labels, as rendered by OpenMetricsSerializer::LabelKey().
+        typedef std::unordered_map<std::string, std::unordered_map<std::string, Exemplar>> ExemplarMap;
+
+        // Serializes metric families in the OpenMetrics text format, which is the same as Prometheus' text format,
+        // except for the counters' naming, the # EOF at the end, and the exemplars, which prometheus-cpp can't give us.
+        class OpenMetricsSerializer
+        {
+        public:
+            static constexpr const char* content_type = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+            std::string Serialize(const std::vector<prometheus::MetricFamily>& families, const ExemplarMap* exemplars) const;
+
+            // How a series' labels (including the family's constant labels) are keyed in an ExemplarMap.
+            static std::string LabelKey(const std::map<std::string, std::string>& labels);
+
+            static std::string EscapeLabelValue(const std::string& value);
+        };
+
+    }
+}
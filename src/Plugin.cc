@@ -1,5 +1,15 @@
+#include <algorithm>
+#include <array>
 #include <chrono>
-#include <stack>
+#include <cmath>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <unistd.h>
+#endif
 
 #include <prometheus/exposer.h>
 #include <prometheus/registry.h>
@@ -7,98 +17,1342 @@
 #include <zeek/ZeekString.h>
 
 #include <zeek/Event.h>
+#include <zeek/EventHandler.h>
 #include <zeek/Func.h>
+#include <zeek/ID.h>
+#include <zeek/Obj.h>
 #include <zeek/Reporter.h>
+#include <zeek/RunState.h>
+#include <zeek/Scope.h>
+#include <zeek/threading/Manager.h>
+#include <zeek/threading/SerialTypes.h>
+#include <zeek/util.h>
+#include <zeek/zeek-version.h>
 
 #include "Plugin.h"
 
+// Zeek 6 deprecated TableVal::MemoryAllocation(), with nothing to replace it, so from then on the global tables' sizes
+// are all estimated.
+#if ZEEK_VERSION_NUMBER < 60000
+#define HAVE_MEMORY_ALLOCATION
+#endif
+
 namespace plugin { namespace ESnet_Zeek_Exporter { Plugin plugin; } }
 
 using namespace plugin::ESnet_Zeek_Exporter;
 
 Plugin::Plugin() {
     // Constructor
+    counter_families = {&zeek_log_writes_total, &zeek_log_write_bytes_total, &zeek_log_write_fields_total,
+                        &zeek_start_time_seconds, &zeek_function_calls_total, &zeek_cpu_time_per_function_seconds,
+                        &zeek_cpu_time_per_script_seconds, &zeek_absolute_cpu_time_per_function_seconds,
+                        &zeek_cpu_time_per_function_type_seconds, &zeek_hook_cpu_time_seconds,
+                        &zeek_dropped_label_values_total, &zeek_hooks_total, &zeek_cpu_time_per_service_seconds,
+                        &zeek_plugin_overhead_seconds};
+
     zeek_total_cpu_time_seconds.Add({{"type", "PluginInstantiation"}}, (double) clock()/CLOCKS_PER_SEC);
 }
 
-void Plugin::InitPreScript() {
-    // First-stage initializion
-    zeek_total_cpu_time_seconds.Add({{"type", "InitPreScript"}}, (double) clock()/CLOCKS_PER_SEC);
+void Plugin::InitPreScript() {
+    // First-stage initializion
+    zeek_total_cpu_time_seconds.Add({{"type", "InitPreScript"}}, (double) clock()/CLOCKS_PER_SEC);
+}
+
+void Plugin::InitPostScript()
+{
+    // Third-stage initialization
+    zeek_total_cpu_time_seconds.Add({{"type", "InitPostScript"}}, (double) clock()/CLOCKS_PER_SEC);
+
+    // if we go straight to c_str() and assign bind_ip as a char* things get weird.
+    const std::string bind_ip = zeek::BifConst::Exporter::bind_address->AsAddr().AsString();
+    const uint32_t bind_port = zeek::BifConst::Exporter::bind_port->Port();
+
+    const char* timing_source_name = zeek::BifConst::Exporter::timing_source->CheckString();
+    Clock::Source timing_source;
+    if ( ! Clock::ParseSource(timing_source_name, timing_source) )
+    {
+        zeek::reporter->Warning("%s: unknown timing source '%s', using steady_clock", plugin_name, timing_source_name);
+        timing_source = Clock::STEADY_CLOCK;
+    }
+
+    ConfigureEnabledMetrics();
+
+    sample_rate = std::max<uint64_t>(zeek::BifConst::Exporter::sample_rate, 1);
+    arg_label_limit = zeek::id::find_val("Exporter::arg_label_limit")->AsCount();
+    function_histograms = zeek::BifConst::Exporter::function_histograms && ( enabled_metrics & METRICS_FUNCTION_TIMES );
+    log_write_bytes = zeek::BifConst::Exporter::log_write_bytes && ( enabled_metrics & METRICS_LOG_WRITES );
+    call_path_profiling = zeek::BifConst::Exporter::call_path_profiling && ( enabled_metrics & METRICS_FUNCTION_TIMES );
+    service_costs = zeek::BifConst::Exporter::service_costs;
+    exemplars = zeek::BifConst::Exporter::exemplars && ( enabled_metrics & METRICS_FUNCTION_TIMES );
+
+    slow_call_threshold = zeek::BifConst::Exporter::slow_call_threshold * 1000000.0;
+    if ( slow_call_threshold > 0 && ( enabled_metrics & METRICS_FUNCTION_TIMES ) )
+        slow_calls.SetCapacity(std::max<uint64_t>(zeek::BifConst::Exporter::slow_call_buffer_size, 1));
+
+    double flush_interval = zeek::id::find_val("Exporter::flush_interval")->AsInterval();
+    flamegraph_every_flushes = std::max<uint64_t>(flamegraph_interval / std::max(flush_interval, 0.001), 1);
+
+    if ( zeek::BifConst::Exporter::series_ttl > 0 )
+    {
+        series_ttl_flushes = std::max<uint64_t>(std::ceil(zeek::BifConst::Exporter::series_ttl / std::max(flush_interval, 0.001)), 1);
+        // Checking every entry is too much to do on every flush, but it's fine for series to live up to 25% longer.
+        evict_every_flushes = std::max<uint64_t>(series_ttl_flushes / 4, 1);
+    }
+
+    memory_top_globals = zeek::BifConst::Exporter::memory_top_globals;
+    memory_walk_budget = zeek::BifConst::Exporter::memory_walk_budget * 1000000.0;
+    memory_walk_max_elements = zeek::BifConst::Exporter::memory_walk_max_elements;
+
+    caller_top_k = zeek::BifConst::Exporter::track_lineage ? zeek::BifConst::Exporter::caller_top_k : 0;
+    if ( caller_top_k )
+    {
+        caller_sketch.SetCapacity(caller_top_k * caller_sketch_oversize);
+        caller_sketch_decay = std::pow(0.5, std::max(flush_interval, 0.001) / caller_sketch_half_life);
+    }
+
+    event_queue_metrics = zeek::BifConst::Exporter::event_queue_metrics;
+    if ( event_queue_metrics )
+    {
+        event_queue_latency = BufferHistogram();
+        event_queue_latency->histogram = &zeek_event_queue_latency_seconds.Add({}, LatencyBuckets::Boundaries());
+        event_queue_depth = BufferHistogram(CountBuckets::num_buckets);
+        event_queue_depth->histogram = &zeek_event_queue_depth.Add({}, CountBuckets::Boundaries());
+
+        // These run for every event, so unlike our other hooks, they're only enabled once we know they're wanted.
+        // We want to see events *after* other plugins get a chance to handle them, so low priority here.
+        EnableHook(zeek::plugin::HOOK_QUEUE_EVENT, -20);
+        EnableHook(zeek::plugin::HOOK_DRAIN_EVENTS);
+    }
+    log_write_bytes_sample_rate = std::max<uint64_t>(zeek::BifConst::Exporter::log_write_bytes_sample_rate, 1);
+
+    SelectCallHandler();
+
+    if ( ! clock_source.Init(timing_source) )
+        zeek::reporter->Warning("%s: timing source '%s' isn't available on this system, using steady_clock", plugin_name, timing_source_name);
+
+    const char* exposition_mode = zeek::BifConst::Exporter::exposition_mode->CheckString();
+
+    ship_deltas = zeek::BifConst::Exporter::cluster_aggregation && getenv("CLUSTER_NODE") && ! IsClusterManager(node_name);
+
+    try
+    {
+        if ( ship_deltas )
+        {
+            // The manager exposes our metrics for us. See TakeDeltas().
+        }
+        else if ( strcmp(exposition_mode, "push") == 0 )
+        {
+            try
+            {
+                pusher = std::make_shared<Pusher>(zeek::BifConst::Exporter::push_url->CheckString(),
+                                                  zeek::BifConst::Exporter::push_job->CheckString(), node_name,
+                                                  std::max(zeek::BifConst::Exporter::push_interval, 1.0));
+                pusher->RegisterCollectable(registry);
+            }
+            catch ( const std::exception& e )
+            {
+                zeek::reporter->Warning("%s can't push to %s: %s", plugin_name, zeek::BifConst::Exporter::push_url->CheckString(), e.what());
+            }
+        }
+        else if ( strcmp(exposition_mode, "snapshot") == 0 )
+        {
+            snapshot_server = std::make_shared<SnapshotServer>(bind_ip, bind_port, zeek::BifConst::Exporter::snapshot_gzip);
+            snapshot_server->RegisterCollectable(registry);
+            snapshot_server->RequestUpdate();
+        }
+        else
+        {
+            if ( strcmp(exposition_mode, "exposer") != 0 )
+                zeek::reporter->Warning("%s: unknown exposition mode '%s', using exposer", plugin_name, exposition_mode);
+
+            if(zeek::BifConst::Exporter::bind_address->AsAddr().GetFamily() == IPv4){
+                exposer = std::make_shared<prometheus::Exposer>(zeek::util::fmt("%s:%d", bind_ip.c_str(), bind_port));
+            }else if(zeek::BifConst::Exporter::bind_address->AsAddr().GetFamily() == IPv6){
+                // 3rdparty civetweb expects ipv6 addresses in brackets as well 
+                exposer = std::make_shared<prometheus::Exposer>(zeek::util::fmt("[%s]:%d", bind_ip.c_str(), bind_port));
+            }
+            exposer->RegisterCollectable(registry);
+        }
+
+        zeek_start_time_seconds.Add({{"type", "plugin_start_time"}}).Increment(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+    }
+    catch ( const std::exception& )
+    {
+        zeek::reporter->Warning("%s failed to bind to %s:%d", plugin_name, bind_ip.c_str(), bind_port);
+    }
+
+    // prometheus-cpp's serializers have no room for exemplars, so only our own server can expose them.
+    if ( exemplars && ! snapshot_server )
+    {
+        zeek::reporter->Warning("%s: Exporter::exemplars needs the \"snapshot\" exposition mode", plugin_name);
+        exemplars = false;
+    }
+}
+
+void Plugin::Done()
+{
+    // Make sure the final values make it out
+    FlushMetrics();
+
+    if ( pusher )
+        pusher->Stop();
+
+    // Don't hold on to a script value past Zeek's own shutdown.
+    last_services = nullptr;
+}
+
+void Plugin::FlushMetrics()
+{
+    // New functions only get their labels now, so that their counters exist by the time we publish them.
+    if ( caller_top_k )
+        PromoteTopCallers();
+
+    SymbolizeFuncMetrics();
+
+    flush_count++;
+
+    for ( auto& pending : pending_counters )
+    {
+        if ( pending.value )
+        {
+            pending.counter->Increment(pending.value);
+            pending.updated = flush_count;
+
+            if ( ship_deltas )
+            {
+                if ( ! pending.series->unshipped )
+                    unshipped_series.push_back(pending.series);
+
+                pending.series->unshipped += pending.value;
+            }
+
+            pending.value = 0.0;
+        }
+    }
+
+    for ( auto& pending : pending_histograms )
+    {
+        if ( ! pending.dirty )
+            continue;
+
+        std::vector<double> increments(pending.buckets, pending.buckets + pending.num_buckets);
+        pending.histogram->ObserveMultiple(increments, pending.sum);
+
+        std::fill(pending.buckets, pending.buckets + pending.num_buckets, 0);
+        pending.sum = 0.0;
+        pending.dirty = false;
+    }
+
+    // This has to come before eviction, which may remove the FuncMetrics we point to.
+    if ( exemplars )
+        PublishExemplars();
+
+    if ( series_ttl_flushes && flush_count % evict_every_flushes == 0 )
+        EvictIdleSeries();
+
+    if ( enabled_metrics & METRICS_PROCESS_CPU_TIME )
+        SampleCPUTime();
+
+    SampleMsgThreads();
+
+    if ( snapshot_server )
+    {
+        snapshot_server->RequestUpdate();
+
+        // The call path tree can have up to max_call_path_nodes paths to render, so it's done less often than the
+        // metrics, and only once something's been added to it.
+        if ( call_path_profiling && call_paths_changed && flush_count % flamegraph_every_flushes == 0 )
+        {
+            snapshot_server->Publish("/flamegraph", "text/plain; charset=utf-8", FoldedStacks());
+            call_paths_changed = false;
+        }
+
+        // Slow calls are rare, so most flushes don't have anything new to render.
+        if ( slow_calls.Enabled() && slow_calls.Recorded() != published_slow_calls )
+        {
+            snapshot_server->Publish("/slow_calls", "application/json", SlowCalls("json"));
+            snapshot_server->Publish("/slow_calls/trace", "application/json", SlowCalls("chrome"));
+            published_slow_calls = slow_calls.Recorded();
+        }
+    }
+
+    std::string push_error;
+    if ( pusher && pusher->TakeError(push_error) )
+        zeek::reporter->Warning("%s failed to push to %s: %s", plugin_name, zeek::BifConst::Exporter::push_url->CheckString(), push_error.c_str());
+}
+
+void Plugin::SampleCPUTime()
+{
+    // This runs once per flush, rather than on every hook, since that's as often as anyone can see it anyway.
+    cpu_time_gauge.Set((double) clock()/CLOCKS_PER_SEC);
+
+#ifdef __linux__
+    // clock() is the sum of all of our threads, so we also break it down by thread, the way top -H would. Threads can
+    // share a name, e.g. if they're truncated, so the times get summed by name.
+    for ( auto& thread : thread_cpu_times )
+        thread.second.time = 0.0;
+
+    static const long ticks_per_second = sysconf(_SC_CLK_TCK);
+
+    DIR* tasks = opendir("/proc/self/task");
+    if ( ! tasks )
+        return;
+
+    while ( struct dirent* task = readdir(tasks) )
+    {
+        if ( task->d_name[0] == '.' )
+            continue;
+
+        std::ifstream stat_file(std::string("/proc/self/task/") + task->d_name + "/stat");
+        std::string stat;
+        if ( ! std::getline(stat_file, stat) )
+            continue;
+
+        // <tid> (<name>) <state> ..., where the name can contain anything, including spaces and parentheses.
+        size_t name_start = stat.find('(');
+        size_t name_end = stat.rfind(')');
+        if ( name_start == std::string::npos || name_end == std::string::npos || name_end < name_start )
+            continue;
+
+        // utime and stime are the 12th and 13th fields after the name.
+        std::istringstream fields(stat.substr(name_end + 1));
+        std::string field;
+        for ( int i = 0; i < 11; ++i )
+            fields >> field;
+
+        uint64_t utime = 0, stime = 0;
+        if ( ! ( fields >> utime >> stime ) )
+            continue;
+
+        std::string name = stat.substr(name_start + 1, name_end - name_start - 1);
+        ThreadCPUTime& thread = thread_cpu_times[name];
+        if ( ! thread.gauge )
+            thread.gauge = &zeek_thread_cpu_time_seconds.Add({{"thread", name}});
+
+        thread.time += (double) ( utime + stime ) / ticks_per_second;
+    }
+
+    closedir(tasks);
+
+    // Threads which went away drop to 0.
+    for ( auto& thread : thread_cpu_times )
+        thread.second.gauge->Set(thread.second.time);
+#endif
+}
+
+void Plugin::SampleMsgThreads()
+{
+    const auto& threads = zeek::thread_mgr->GetMsgThreadStats();
+
+    // We can only tell the threads' CPU time apart by their OS names, which Linux truncates to 15 characters, and
+    // which some Zeek versions prefix with "zk.". If several threads end up with the same name, we can't tell which of
+    // them the time was spent in.
+    auto os_name_of = [this](const std::string& name) {
+        std::string prefixed = ( "zk." + name ).substr(0, 15);
+        return thread_cpu_times.count(prefixed) ? prefixed : name.substr(0, 15);
+    };
+
+    std::map<std::string, int> os_names;
+    for ( const auto& thread : threads )
+        os_names[os_name_of(thread.first)]++;
+
+    for ( auto& thread : msg_thread_metrics )
+        thread.second.seen = false;
+
+    for ( const auto& thread : threads )
+    {
+        const std::string& name = thread.first;
+        const zeek::threading::MsgThread::Stats& stats = thread.second;
+
+        MsgThreadMetrics& metrics = msg_thread_metrics[name];
+        if ( ! metrics.pending_in )
+        {
+            metrics.pending_in = &zeek_msg_thread_queue_depth.Add({{"thread", name}, {"queue", "in"}});
+            metrics.pending_out = &zeek_msg_thread_queue_depth.Add({{"thread", name}, {"queue", "out"}});
+            metrics.messages_in = &zeek_msg_thread_messages_total.Add({{"thread", name}, {"queue", "in"}});
+            metrics.messages_out = &zeek_msg_thread_messages_total.Add({{"thread", name}, {"queue", "out"}});
+        }
+
+        metrics.seen = true;
+        metrics.pending_in->Set(stats.pending_in);
+        metrics.pending_out->Set(stats.pending_out);
+
+        // A thread that was replaced by another with the same name starts counting over.
+        metrics.messages_in->Increment(stats.sent_in >= metrics.sent_in ? stats.sent_in - metrics.sent_in : stats.sent_in);
+        metrics.messages_out->Increment(stats.sent_out >= metrics.sent_out ? stats.sent_out - metrics.sent_out : stats.sent_out);
+        metrics.sent_in = stats.sent_in;
+        metrics.sent_out = stats.sent_out;
+
+        // SampleCPUTime() just went through the threads in /proc.
+        std::string os_name = os_name_of(name);
+        auto cpu_time = thread_cpu_times.find(os_name);
+        if ( os_names[os_name] == 1 && cpu_time != thread_cpu_times.end() )
+        {
+            if ( ! metrics.cpu_time )
+                metrics.cpu_time = &zeek_msg_thread_cpu_time_seconds.Add({{"thread", name}});
+
+            metrics.cpu_time->Set(cpu_time->second.time);
+        }
+    }
+
+    // Threads finish when their log or input stream goes away, and their series go with them.
+    for ( auto it = msg_thread_metrics.begin(); it != msg_thread_metrics.end(); )
+    {
+        if ( it->second.seen )
+        {
+            ++it;
+            continue;
+        }
+
+        MsgThreadMetrics& metrics = it->second;
+        zeek_msg_thread_queue_depth.Remove(metrics.pending_in);
+        zeek_msg_thread_queue_depth.Remove(metrics.pending_out);
+        zeek_msg_thread_messages_total.Remove(metrics.messages_in);
+        zeek_msg_thread_messages_total.Remove(metrics.messages_out);
+        if ( metrics.cpu_time )
+            zeek_msg_thread_cpu_time_seconds.Remove(metrics.cpu_time);
+
+        it = msg_thread_metrics.erase(it);
+    }
+}
+
+void Plugin::SampleMemory()
+{
+    if ( ! rss_gauge )
+    {
+        rss_gauge = &zeek_memory_bytes.Add({{"type", "rss"}});
+        max_rss_gauge = &zeek_memory_bytes.Add({{"type", "max_rss"}});
+        malloced_gauge = &zeek_memory_bytes.Add({{"type", "malloced"}});
+    }
+
+#ifdef __linux__
+    // The resident set size is statm's second field, in pages.
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size = 0, resident = 0;
+    if ( statm >> size >> resident )
+        rss_gauge->Set(resident * sysconf(_SC_PAGESIZE));
+#endif
+
+    uint64_t max_rss = 0, malloced = 0;
+    zeek::util::get_memory_usage(&max_rss, &malloced);
+    max_rss_gauge->Set(max_rss);
+    malloced_gauge->Set(malloced);
+
+    if ( memory_top_globals )
+        WalkGlobals();
+}
+
+void Plugin::WalkGlobals()
+{
+    const auto& globals = zeek::detail::global_scope()->Vars();
+    uint64_t start = clock_source.Now();
+
+    // We pick up after the last global we measured by name, which still works if globals were added in between.
+    for ( auto it = globals.upper_bound(memory_walk_cursor); it != globals.end(); ++it )
+    {
+        const auto& id = it->second;
+        if ( ! id->HasVal() || id->GetType()->Tag() != zeek::TYPE_TABLE )
+            continue;
+
+        const zeek::TableVal* table = id->GetVal()->AsTableVal();
+        uint64_t elements = table->Size();
+        memory_walk_cursor = it->first;
+
+#ifdef HAVE_MEMORY_ALLOCATION
+        // The budget is only checked between tables, so a table too big to measure in one go gets estimated, in
+        // PublishGlobalSizes().
+        if ( memory_walk_max_elements && elements > memory_walk_max_elements )
+        {
+            memory_walk_sizes.push_back({it->first, elements, 0, true});
+            continue;
+        }
+
+        uint64_t bytes = table->MemoryAllocation();
+        memory_walk_sizes.push_back({it->first, elements, bytes, false});
+        if ( elements )
+            global_element_bytes[it->first] = (double) bytes / elements;
+#else
+        memory_walk_sizes.push_back({it->first, elements, 0, true});
+#endif
+
+        if ( clock_source.Microseconds(clock_source.Now() - start) >= memory_walk_budget )
+            return;
+    }
+
+    // We got through all of them.
+    PublishGlobalSizes();
+    memory_walk_cursor.clear();
+    memory_walk_sizes.clear();
+}
+
+void Plugin::PublishGlobalSizes()
+{
+    uint64_t measured_elements = 0;
+    uint64_t measured_bytes = 0;
+    for ( const GlobalSize& global : memory_walk_sizes )
+    {
+        if ( ! global.estimated )
+        {
+            measured_elements += global.elements;
+            measured_bytes += global.bytes;
+        }
+    }
+
+    double average_element_bytes = measured_elements ? (double) measured_bytes / measured_elements : typical_element_bytes;
+    for ( GlobalSize& global : memory_walk_sizes )
+    {
+        if ( ! global.estimated )
+            continue;
+
+        auto last = global_element_bytes.find(global.name);
+        global.bytes = global.elements * ( last != global_element_bytes.end() ? last->second : average_element_bytes );
+    }
+
+    size_t count = std::min<size_t>(memory_top_globals, memory_walk_sizes.size());
+    std::partial_sort(memory_walk_sizes.begin(), memory_walk_sizes.begin() + count, memory_walk_sizes.end(),
+                      [](const GlobalSize& a, const GlobalSize& b) { return a.bytes > b.bytes; });
+
+    std::set<std::string> largest;
+    for ( size_t i = 0; i < count; ++i )
+    {
+        const GlobalSize& global = memory_walk_sizes[i];
+        GlobalGauges& gauges = global_gauges[global.name];
+        if ( ! gauges.elements )
+        {
+            gauges.elements = &zeek_global_elements.Add({{"name", global.name}});
+            gauges.bytes = &zeek_global_bytes.Add({{"name", global.name}});
+        }
+
+        gauges.elements->Set(global.elements);
+        gauges.bytes->Set(global.bytes);
+        largest.insert(global.name);
+    }
+
+    // Globals that aren't among the largest anymore go away, rather than showing how big they used to be.
+    for ( auto it = global_gauges.begin(); it != global_gauges.end(); )
+    {
+        if ( largest.count(it->first) )
+        {
+            ++it;
+            continue;
+        }
+
+        zeek_global_elements.Remove(it->second.elements);
+        zeek_global_bytes.Remove(it->second.bytes);
+        it = global_gauges.erase(it);
+    }
+}
+
+void Plugin::ConfigureEnabledMetrics()
+{
+    static const std::pair<const char*, uint32_t> groups[] = {
+        {"FUNCTION_CALLS", METRICS_FUNCTION_CALLS},
+        {"FUNCTION_TIMES", METRICS_FUNCTION_TIMES},
+        {"PLUGIN_HOOKS", METRICS_PLUGIN_HOOKS},
+        {"LOG_WRITES", METRICS_LOG_WRITES},
+        {"PROCESS_CPU_TIME", METRICS_PROCESS_CPU_TIME},
+    };
+
+    const auto& enabled = zeek::id::find_val<zeek::TableVal>("Exporter::enabled_metrics");
+    const auto& group_type = zeek::id::find_type<zeek::EnumType>("Exporter::MetricGroup");
+
+    enabled_metrics = 0;
+    for ( const auto& group : groups )
+    {
+        if ( enabled->Find(group_type->GetEnumVal(group_type->Lookup("Exporter", group.first))) )
+            enabled_metrics |= group.second;
+    }
+
+    // Counters in these families get handed the discarded counter, so the hot path doesn't need to check.
+    if ( ! ( enabled_metrics & METRICS_FUNCTION_CALLS ) )
+        disabled_families.push_back(&zeek_function_calls_total);
+
+    if ( ! ( enabled_metrics & METRICS_FUNCTION_TIMES ) )
+        disabled_families.insert(disabled_families.end(), {&zeek_cpu_time_per_function_seconds, &zeek_absolute_cpu_time_per_function_seconds,
+                                                           &zeek_cpu_time_per_function_type_seconds, &zeek_cpu_time_per_script_seconds,
+                                                           &zeek_cpu_time_per_service_seconds});
+
+    if ( ! ( enabled_metrics & METRICS_PLUGIN_HOOKS ) )
+        disabled_families.insert(disabled_families.end(), {&zeek_hooks_total, &zeek_hook_cpu_time_seconds, &zeek_plugin_overhead_seconds});
+
+    if ( ! ( enabled_metrics & METRICS_LOG_WRITES ) )
+        disabled_families.push_back(&zeek_log_writes_total);
+
+    addl_arg_hook_cpu_time_seconds = BufferCounter(zeek_hook_cpu_time_seconds, {{"plugin", plugin_name}, {"hook", "AddlArgumentPopulation"}});
+    self_overhead_seconds = BufferCounter(zeek_plugin_overhead_seconds, {{"hook", "HookFunctionCall"}});
+
+    // Don't even hook what we don't need. These can't be left out in Configure(), since that's called before the
+    // scripts are loaded.
+    // The event queue latency is measured when we see the event's handler get called.
+    bool hook_functions = ( enabled_metrics & ( METRICS_FUNCTION_CALLS | METRICS_FUNCTION_TIMES ) ) ||
+            zeek::BifConst::Exporter::event_queue_metrics;
+    if ( ! hook_functions )
+        DisableHook(zeek::plugin::HOOK_CALL_FUNCTION);
+
+    if ( ! ( enabled_metrics & METRICS_LOG_WRITES ) )
+        DisableHook(zeek::plugin::HOOK_LOG_WRITE);
+
+    // The meta hooks are only there for the plugin hook metrics. They're the expensive part of hooking a function,
+    // since Zeek builds an argument list for each of them, on every call, and twice for the calls we time.
+    if ( ! ( enabled_metrics & METRICS_PLUGIN_HOOKS ) )
+    {
+        DisableHook(zeek::plugin::META_HOOK_PRE);
+        DisableHook(zeek::plugin::META_HOOK_POST);
+    }
+}
+
+zeek::VectorValPtr Plugin::TakeDeltas()
+{
+    static auto delta_type = zeek::id::find_type<zeek::RecordType>("Exporter::MetricDelta");
+    static auto deltas_type = zeek::id::find_type<zeek::VectorType>("Exporter::MetricDeltas");
+
+    auto deltas = zeek::make_intrusive<zeek::VectorVal>(deltas_type);
+
+    for ( CounterSeries* series : unshipped_series )
+    {
+        size_t family = std::find(counter_families.begin(), counter_families.end(), series->family) - counter_families.begin();
+
+        auto labels = zeek::make_intrusive<zeek::VectorVal>(zeek::id::string_vec);
+        for ( const auto& label : series->labels )
+            labels->Assign(labels->Size(), zeek::make_intrusive<zeek::StringVal>(label));
+
+        auto delta = zeek::make_intrusive<zeek::RecordVal>(delta_type);
+        delta->Assign(0, zeek::val_mgr->Count(family));
+        delta->Assign(1, std::move(labels));
+        delta->Assign(2, zeek::make_intrusive<zeek::DoubleVal>(series->unshipped));
+        deltas->Assign(deltas->Size(), std::move(delta));
+
+        series->unshipped = 0.0;
+    }
+
+    unshipped_series.clear();
+    return deltas;
+}
+
+void Plugin::MergeDeltas(const zeek::VectorVal* deltas)
+{
+    for ( unsigned int i = 0; i < deltas->Size(); ++i )
+    {
+        const zeek::RecordVal* delta = deltas->At(i)->AsRecordVal();
+        uint64_t family = delta->GetField(0)->AsCount();
+        const zeek::VectorVal* labels = delta->GetField(1)->AsVectorVal();
+        double value = delta->GetField(2)->AsDouble();
+
+        // Labels are stored as name, value, name, value...
+        if ( family >= counter_families.size() || labels->Size() % 2 || value <= 0 )
+            continue;
+
+        std::map<std::string, std::string> label_map;
+        for ( unsigned int j = 0; j + 1 < labels->Size(); j += 2 )
+            label_map.emplace(labels->At(j)->AsString()->CheckString(), labels->At(j + 1)->AsString()->CheckString());
+
+        // These come in once per interval, so they don't need to be buffered.
+        prometheus::Counter& counter = counter_families[family]->Add(label_map);
+        counter.Increment(value);
+
+        if ( series_ttl_flushes )
+            merged_series[&counter] = {counter_families[family], flush_count};
+    }
+}
+
+bool Plugin::IsClusterManager(const char* node)
+{
+    const auto& nodes = zeek::id::find_val<zeek::TableVal>("Cluster::nodes");
+    auto node_val = nodes->FindOrDefault(zeek::make_intrusive<zeek::StringVal>(node));
+    if ( ! node_val )
+        return false;
+
+    static auto node_type = zeek::id::find_type<zeek::EnumType>("Cluster::NodeType");
+    return node_val->AsRecordVal()->GetField("node_type")->AsEnum() == node_type->Lookup("Cluster", "MANAGER");
+}
+
+zeek::plugin::Configuration Plugin::Configure()
+{
+    zeek::plugin::Configuration config;
+    config.name = plugin_name;
+    config.description = "Prometheus exporter for Zeek";
+    config.version.major = 0;
+    config.version.minor = 5;
+
+    // We want to track functions even if they get handled by another hook, so high priority here
+    EnableHook(zeek::plugin::HOOK_CALL_FUNCTION, 1000001);
+
+    // Default priority is fine here
+    EnableHook(zeek::plugin::META_HOOK_PRE);
+    EnableHook(zeek::plugin::META_HOOK_POST);
+
+    // We want to track these *after* other plugins get a chance to handle them, so low priority
+    EnableHook(zeek::plugin::HOOK_LOG_WRITE, -20);
+
+    // The event queue hooks are enabled in InitPostScript(), with Exporter::event_queue_metrics.
+
+    return config;
+}
+
+static const char* FunctionType(const zeek::Func* func)
+{
+    switch ( func->Flavor() )
+    {
+        case zeek::FUNC_FLAVOR_FUNCTION:
+            return func->GetKind() ? "built-in function" : "script-land function";
+        case zeek::FUNC_FLAVOR_EVENT:
+            return "event";
+        case zeek::FUNC_FLAVOR_HOOK:
+            return "hook";
+        default:
+            return "unknown";
+    }
+}
+
+Plugin::PendingCounter* Plugin::BufferCounter(prometheus::Family<prometheus::Counter>& family, const std::map<std::string, std::string>& labels)
+{
+    if ( ! FamilyEnabled(family) )
+        return &discarded_counter;
+
+    prometheus::Counter& counter = family.Add(labels);
+    PendingCounter*& pending = buffered_counters[&counter];
+    if ( pending )
+    {
+        pending->refs++;
+        return pending;
+    }
+
+    pending = NewPendingCounter();
+    AttachCounter(pending, family, labels);
+    return pending;
+}
+
+Plugin::PendingCounter* Plugin::DeferCounter(prometheus::Family<prometheus::Counter>& family)
+{
+    if ( ! FamilyEnabled(family) )
+        return &discarded_counter;
+
+    return NewPendingCounter();
+}
+
+Plugin::PendingCounter* Plugin::NewPendingCounter()
+{
+    PendingCounter* pending;
+    if ( free_counters.empty() )
+    {
+        pending_counters.push_back({nullptr, 0.0, nullptr, 0, 0});
+        pending = &pending_counters.back();
+    }
+    else
+    {
+        pending = free_counters.back();
+        free_counters.pop_back();
+    }
+
+    // A new counter counts as updated, so it doesn't get evicted before its first use.
+    pending->refs = 1;
+    pending->updated = flush_count;
+    return pending;
+}
+
+void Plugin::AttachCounter(PendingCounter* pending, prometheus::Family<prometheus::Counter>& family, const std::map<std::string, std::string>& labels)
+{
+    if ( pending == &discarded_counter )
+        return;
+
+    pending->counter = &family.Add(labels);
+    counter_refs[pending->counter]++;
+
+    // A reused PendingCounter keeps its series.
+    if ( ! pending->series )
+    {
+        counter_series.push_back({nullptr, {}, 0.0});
+        pending->series = &counter_series.back();
+    }
+
+    pending->series->family = &family;
+    pending->series->labels.clear();
+    for ( const auto& label : labels )
+    {
+        pending->series->labels.push_back(label.first);
+        pending->series->labels.push_back(label.second);
+    }
+}
+
+void Plugin::ReleaseCounter(PendingCounter* pending)
+{
+    if ( pending == &discarded_counter || --pending->refs )
+        return;
+
+    if ( prometheus::Counter* counter = pending->counter )
+    {
+        auto buffered = buffered_counters.find(counter);
+        if ( buffered != buffered_counters.end() && buffered->second == pending )
+            buffered_counters.erase(buffered);
+
+        auto refs = counter_refs.find(counter);
+        if ( --refs->second == 0 )
+        {
+            counter_refs.erase(refs);
+
+            // On the manager, other nodes may still be shipping deltas for the same series, in which case it stays,
+            // and merged_series removes it once they've stopped too.
+            auto merged = merged_series.find(counter);
+            if ( merged == merged_series.end() || flush_count - merged->second.second >= series_ttl_flushes )
+            {
+                if ( merged != merged_series.end() )
+                    merged_series.erase(merged);
+
+                pending->series->family->Remove(counter);
+            }
+        }
+    }
+
+    pending->counter = nullptr;
+    pending->value = 0.0;
+    free_counters.push_back(pending);
+}
+
+bool Plugin::SeriesIdle(const PendingCounter* pending) const
+{
+    // The discarded counter never gets flushed, so it can't tell us anything.
+    return pending == &discarded_counter || flush_count - pending->updated >= series_ttl_flushes;
+}
+
+void Plugin::EvictIdleSeries()
+{
+    // This runs right after the counters were flushed, so none of them have anything pending. Nothing holds on to
+    // FuncMetrics or LogMetrics across a flush, so we can drop the cache entries along with their counters.
+    for ( auto it = func_metrics.begin(); it != func_metrics.end(); )
+    {
+        FuncMetrics& metrics = it->second;
+        bool discarded = metrics.calls == &discarded_counter && metrics.cpu_time == &discarded_counter;
+
+        // Calls with arg labels add to an arg_func_metrics entry's calls and cpu_time instead of ours, so a busy
+        // event can look idle by those alone. The entry is only idle once none of its counters have been updated.
+        std::initializer_list<PendingCounter*> counters = {metrics.calls_by_type, metrics.cpu_time_by_type,
+                                                           metrics.cpu_time_by_script, metrics.calls,
+                                                           metrics.cpu_time, metrics.absolute_cpu_time};
+        bool idle = std::all_of(counters.begin(), counters.end(), [this](const PendingCounter* pending) { return SeriesIdle(pending); });
+        if ( discarded || ! idle )
+        {
+            ++it;
+            continue;
+        }
+
+        for ( PendingCounter* pending : counters )
+            ReleaseCounter(pending);
+
+        it = func_metrics.erase(it);
+    }
+
+    for ( auto it = arg_func_metrics.begin(); it != arg_func_metrics.end(); )
+    {
+        FuncMetrics& metrics = it->second;
+        bool discarded = metrics.calls == &discarded_counter && metrics.cpu_time == &discarded_counter;
+        if ( discarded || ! SeriesIdle(metrics.calls) || ! SeriesIdle(metrics.cpu_time) )
+        {
+            ++it;
+            continue;
+        }
+
+        for ( PendingCounter* pending : {metrics.calls, metrics.cpu_time, metrics.absolute_cpu_time} )
+            ReleaseCounter(pending);
+
+        // Values that no other caller still has make room for new ones under Exporter::arg_label_limit.
+        ReleaseArgValues(it->first);
+        it = arg_func_metrics.erase(it);
+    }
+
+    for ( auto it = log_metrics.begin(); it != log_metrics.end(); )
+    {
+        LogMetrics& metrics = it->second;
+        if ( ! metrics.writes || metrics.writes == &discarded_counter || ! SeriesIdle(metrics.writes) )
+        {
+            ++it;
+            continue;
+        }
+
+        ReleaseCounter(metrics.writes);
+        if ( metrics.bytes )
+        {
+            ReleaseCounter(metrics.bytes);
+            ReleaseCounter(metrics.fields);
+        }
+
+        it = log_metrics.erase(it);
+    }
+
+    for ( auto it = merged_series.begin(); it != merged_series.end(); )
+    {
+        // Our own counters for the same series keep it around.
+        if ( flush_count - it->second.second < series_ttl_flushes || counter_refs.count(it->first) )
+        {
+            ++it;
+            continue;
+        }
+
+        it->second.first->Remove(it->first);
+        it = merged_series.erase(it);
+    }
+}
+
+bool Plugin::FamilyEnabled(const prometheus::Family<prometheus::Counter>& family) const
+{
+    return std::find(disabled_families.begin(), disabled_families.end(), &family) == disabled_families.end();
+}
+
+Plugin::PendingHistogram* Plugin::BufferHistogram(size_t num_buckets)
+{
+    pending_histograms.emplace_back();
+    PendingHistogram& pending = pending_histograms.back();
+    pending.histogram = nullptr;
+    pending.num_buckets = num_buckets;
+    std::fill(pending.buckets, pending.buckets + LatencyBuckets::num_buckets, 0);
+    pending.sum = 0.0;
+    pending.dirty = false;
+    return &pending;
+}
+
+uint32_t Plugin::InternFunc(const zeek::Func* func)
+{
+    auto it = func_ids.find(func);
+    if ( it != func_ids.end() )
+        return it->second;
+
+    uint32_t id = func_names.size();
+    func_names.emplace_back(func->Name());
+    func_ids.emplace(func, id);
+    return id;
+}
+
+Plugin::PendingCounter* Plugin::ResolveServiceCounter(zeek::Args* args)
+{
+    // Only events about a connection, i.e. whose first argument is one.
+    if ( args->empty() || (*args)[0]->GetType().get() != zeek::id::connection.get() )
+        return nullptr;
+
+    static int service_offset = zeek::id::connection->FieldOffset("service");
+    const auto& services = (*args)[0]->AsRecordVal()->GetField(service_offset);
+
+    // Most connection events are for connections whose service isn't known yet.
+    int num_services = services ? services->AsTableVal()->Size() : 0;
+    if ( ! num_services )
+    {
+        if ( ! unknown_service_counter )
+            unknown_service_counter = BufferCounter(zeek_cpu_time_per_service_seconds, {{"service", "unknown"}});
+
+        return unknown_service_counter;
+    }
+
+    // A connection's events tend to come one after another, and its service set only changes when an analyzer gets
+    // added, so we keep the last set (holding a reference, so that its address can't be reused) along with its size.
+    if ( services.get() == last_services.get() && num_services == last_num_services )
+        return last_service_counter;
+
+    // Otherwise we have to list the set. If there are several services, they're sorted, so that the label doesn't
+    // depend on the set's order.
+    auto service_list = services->AsTableVal()->ToPureListVal();
+    std::string service = service_list->Idx(0)->AsString()->CheckString();
+    if ( num_services > 1 )
+    {
+        std::vector<std::string> names;
+        for ( int i = 0; i < service_list->Length(); ++i )
+            names.emplace_back(service_list->Idx(i)->AsString()->CheckString());
+
+        std::sort(names.begin(), names.end());
+        service = names[0];
+        for ( size_t i = 1; i < names.size(); ++i )
+            service += "," + names[i];
+    }
+
+    PendingCounter*& counter = service_counters[service];
+    if ( ! counter )
+        counter = BufferCounter(zeek_cpu_time_per_service_seconds, {{"service", service}});
+
+    last_services = services;
+    last_num_services = num_services;
+    last_service_counter = counter;
+    return counter;
+}
+
+void Plugin::TrackSlowestCall(FuncMetrics& metrics, zeek::Args* args, double duration)
+{
+    // Only the first call in an interval has a duration of more than 0.
+    if ( ! metrics.slowest_duration )
+        slowest_calls.push_back(&metrics);
+
+    metrics.slowest_duration = duration;
+    metrics.slowest_time = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    // clear() keeps the string's capacity, so only the first uid for each function allocates.
+    metrics.slowest_uid.clear();
+    if ( ! args->empty() && (*args)[0]->GetType().get() == zeek::id::connection.get() )
+    {
+        static int uid_offset = zeek::id::connection->FieldOffset("uid");
+        if ( const auto& uid = (*args)[0]->AsRecordVal()->GetField(uid_offset) )
+            metrics.slowest_uid = uid->AsString()->CheckString();
+    }
+}
+
+void Plugin::PublishExemplars()
+{
+    auto& family_exemplars = function_exemplars["zeek_cpu_time_per_function_seconds"];
+
+    for ( FuncMetrics* metrics : slowest_calls )
+    {
+        // Counters in disabled families don't have a series.
+        if ( const CounterSeries* series = metrics->cpu_time->series )
+        {
+            std::map<std::string, std::string> labels = {{"node", node_name}};
+            for ( size_t i = 0; i + 1 < series->labels.size(); i += 2 )
+                labels[series->labels[i]] = series->labels[i + 1];
+
+            Exemplar& exemplar = family_exemplars[OpenMetricsSerializer::LabelKey(labels)];
+            exemplar.labels.clear();
+            if ( ! metrics->slowest_uid.empty() )
+                exemplar.labels = "uid=\"" + OpenMetricsSerializer::EscapeLabelValue(metrics->slowest_uid) + "\"";
+            exemplar.value = metrics->slowest_duration / 1000000.0;
+            exemplar.timestamp = metrics->slowest_time;
+        }
+
+        metrics->slowest_duration = 0.0;
+    }
+
+    slowest_calls.clear();
+
+    double now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    for ( auto it = family_exemplars.begin(); it != family_exemplars.end(); )
+    {
+        if ( now - it->second.timestamp > exemplar_max_age )
+            it = family_exemplars.erase(it);
+        else
+            ++it;
+    }
+
+    snapshot_server->SetExemplars(std::make_shared<const ExemplarMap>(function_exemplars));
+}
+
+uint32_t Plugin::ResolveCallPath(uint32_t parent, uint32_t func_id)
+{
+    uint64_t key = (uint64_t) parent << 32 | func_id;
+    auto it = call_path_children.find(key);
+    if ( it != call_path_children.end() )
+        return it->second;
+
+    // Once the tree is full, new paths get charged to their parent.
+    if ( call_path_nodes.size() >= max_call_path_nodes )
+        return parent;
+
+    uint32_t node = call_path_nodes.size();
+    call_path_nodes.push_back({parent, func_id, 0.0});
+    call_path_children.emplace(key, node);
+    return node;
+}
+
+std::string Plugin::FoldedStacks() const
+{
+    // Each node's children, as a linked list. Parents are always added before their children, so going backwards
+    // leaves the children in the order they were first seen.
+    std::vector<uint32_t> first_child(call_path_nodes.size(), 0);
+    std::vector<uint32_t> next_sibling(call_path_nodes.size(), 0);
+    for ( size_t i = call_path_nodes.size() - 1; i > 0; --i )
+    {
+        next_sibling[i] = first_child[call_path_nodes[i].parent];
+        first_child[call_path_nodes[i].parent] = i;
+    }
+
+    // We walk the tree depth first, keeping the current path in one string that gets cut back to the parent's
+    // length, rather than building a copy of the path for every node. The stack holds the nodes still to visit,
+    // with the length of their parent's path.
+    std::string folded;
+    std::string path;
+    std::vector<std::pair<uint32_t, size_t>> stack;
+    if ( first_child[0] )
+        stack.push_back({first_child[0], 0});
+
+    while ( ! stack.empty() )
+    {
+        uint32_t i = stack.back().first;
+        size_t parent_length = stack.back().second;
+        stack.pop_back();
+
+        if ( next_sibling[i] )
+            stack.push_back({next_sibling[i], parent_length});
+
+        path.resize(parent_length);
+        if ( parent_length )
+            path += ';';
+        path += func_names[call_path_nodes[i].func_id];
+
+        // In microseconds, since flamegraph.pl wants whole numbers.
+        uint64_t self_time = call_path_nodes[i].self_time;
+        if ( self_time )
+        {
+            folded += path;
+            folded += ' ';
+            folded += std::to_string(self_time);
+            folded += '\n';
+        }
+
+        if ( first_child[i] )
+            stack.push_back({first_child[i], path.size()});
+    }
+
+    return folded;
+}
+
+std::string Plugin::SlowCalls(const std::string& format) const
+{
+    return format == "chrome" ? slow_calls.ToChromeTrace(func_names) : slow_calls.ToJSON(func_names);
+}
+
+uint32_t Plugin::CurrentCaller() const
+{
+    // We're frames[func_depth - 1], our parent is func_depth - 2
+    if ( func_depth < 2 )
+        return NO_CALLER;
+
+    return frames[func_depth - 2].func_id;
+}
+
+uint32_t Plugin::TrackCaller(uint32_t func_id, uint32_t caller, double duration)
+{
+    uint64_t key = (uint64_t(func_id) << 32) | caller;
+    caller_sketch.Add(key, duration);
+    return promoted_callers.count(key) ? caller : OTHER_CALLER;
+}
+
+void Plugin::PromoteTopCallers()
+{
+    // Only the current top K have their own series. Their series get created by the next call, like any other new
+    // pair. A pair that drops out goes back to being counted under OTHER_CALLER, and the series it had stops growing
+    // (and gets removed, with Exporter::series_ttl).
+    promoted_callers.clear();
+    for ( const auto& entry : caller_sketch.Top(caller_top_k) )
+        promoted_callers.insert(entry.key);
+
+    // So that a pair which has gone quiet makes way for busier ones.
+    caller_sketch.Decay(caller_sketch_decay);
 }
 
-void Plugin::InitPostScript()
+Plugin::FuncMetrics& Plugin::ResolveFuncMetrics(const zeek::Func* func, uint32_t caller)
 {
-    // Third-stage initialization
-    zeek_total_cpu_time_seconds.Add({{"type", "InitPostScript"}}, (double) clock()/CLOCKS_PER_SEC);
+    FuncCallerKey key = {func, caller};
+    auto it = func_metrics.find(key);
+    if ( it != func_metrics.end() )
+        return it->second;
 
-    // if we go straight to c_str() and assign bind_ip as a char* things get weird.
-    const std::string bind_ip = zeek::BifConst::Exporter::bind_address->AsAddr().AsString();
-    const uint32_t bind_port = zeek::BifConst::Exporter::bind_port->Port();
+    // The counters don't get their labels until SymbolizeFuncMetrics() runs, so that we don't need to look up names,
+    // build labels, and take the families' locks while we're in the middle of a call.
+    FuncMetrics metrics;
+    metrics.arg_offset = -1;
+    metrics.addl_offset = -1;
+    metrics.arg_events_version = 0;
+    metrics.calls_by_type = DeferCounter(zeek_function_calls_total);
+    metrics.cpu_time_by_type = DeferCounter(zeek_cpu_time_per_function_type_seconds);
+    metrics.cpu_time_by_script = DeferCounter(zeek_cpu_time_per_script_seconds);
+    metrics.calls = DeferCounter(zeek_function_calls_total);
+    metrics.cpu_time = DeferCounter(zeek_cpu_time_per_function_seconds);
+    metrics.absolute_cpu_time = DeferCounter(zeek_absolute_cpu_time_per_function_seconds);
 
-    try
+    metrics.duration = nullptr;
+    bool new_histogram = false;
+    if ( function_histograms )
     {
-        if(zeek::BifConst::Exporter::bind_address->AsAddr().GetFamily() == IPv4){
-            exposer = std::make_shared<prometheus::Exposer>(zeek::util::fmt("%s:%d", bind_ip.c_str(), bind_port));
-        }else if(zeek::BifConst::Exporter::bind_address->AsAddr().GetFamily() == IPv6){
-            // 3rdparty civetweb expects ipv6 addresses in brackets as well 
-            exposer = std::make_shared<prometheus::Exposer>(zeek::util::fmt("[%s]:%d", bind_ip.c_str(), bind_port));
+        PendingHistogram*& histogram = func_histograms[func];
+        if ( ! histogram )
+        {
+            histogram = BufferHistogram();
+            new_histogram = true;
         }
-        exposer->RegisterCollectable(registry);
-        zeek_start_time_seconds.Add({{"type", "plugin_start_time"}}).Increment(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
-    }
-    catch ( const std::exception& )
-    {
-        zeek::reporter->Warning("%s failed to bind to %s:%d", plugin_name, bind_ip.c_str(), bind_port);
+
+        metrics.duration = histogram;
     }
+
+    FuncMetrics& resolved = func_metrics.emplace(key, metrics).first->second;
+    DeferSymbolization(func, caller, nullptr, &resolved, new_histogram);
+    return resolved;
 }
 
-zeek::plugin::Configuration Plugin::Configure()
+Plugin::FuncMetrics& Plugin::ResolveArgFuncMetrics(const ArgFuncKey& key)
 {
-    zeek::plugin::Configuration config;
-    config.name = plugin_name;
-    config.description = "Prometheus exporter for Zeek";
-    config.version.major = 0;
-    config.version.minor = 5;
+    auto it = arg_func_metrics.find(key);
+    if ( it != arg_func_metrics.end() )
+        return it->second;
 
-    // We want to track functions even if they get handled by another hook, so high priority here
-    EnableHook(zeek::plugin::HOOK_CALL_FUNCTION, 1000001);
+    // Only the counters with name labels get the argument labels.
+    FuncMetrics metrics = {};
+    metrics.calls = DeferCounter(zeek_function_calls_total);
+    metrics.cpu_time = DeferCounter(zeek_cpu_time_per_function_seconds);
+    metrics.absolute_cpu_time = DeferCounter(zeek_absolute_cpu_time_per_function_seconds);
 
-    // Default priority is fine here
-    EnableHook(zeek::plugin::META_HOOK_PRE);
-    EnableHook(zeek::plugin::META_HOOK_POST);
+    auto inserted = arg_func_metrics.emplace(key, metrics).first;
+    RetainArgValues(key);
+    DeferSymbolization(key.func, key.caller, &inserted->first, &inserted->second, false);
+    return inserted->second;
+}
 
-    // We want to track these *after* other plugins get a chance to handle them, so low priority
-    EnableHook(zeek::plugin::HOOK_LOG_WRITE, -20);
+void Plugin::DeferSymbolization(const zeek::Func* func, uint32_t caller, const ArgFuncKey* arg_key, FuncMetrics* metrics, bool new_histogram)
+{
+    // Lambdas can go away before we get around to symbolizing them, so we hold on to the function until then.
+    zeek::Ref(const_cast<zeek::Func*>(func));
+    unsymbolized.push_back({func, caller, arg_key, metrics, new_histogram});
+}
 
-    return config;
+void Plugin::SymbolizeFuncMetrics()
+{
+    for ( const auto& entry : unsymbolized )
+    {
+        const zeek::Func* func = entry.func;
+        FuncMetrics& metrics = *entry.metrics;
+
+        if ( entry.arg_key )
+        {
+            std::map<std::string, std::string> labels = ArgLabels(*entry.arg_key);
+            AttachCounter(metrics.calls, zeek_function_calls_total, labels);
+            AttachCounter(metrics.cpu_time, zeek_cpu_time_per_function_seconds, labels);
+            AttachCounter(metrics.absolute_cpu_time, zeek_absolute_cpu_time_per_function_seconds, labels);
+        }
+        else
+        {
+            std::map<std::string, std::string> labels = {{"function_type", FunctionType(func)}};
+            AttachCounter(metrics.calls_by_type, zeek_function_calls_total, labels);
+            AttachCounter(metrics.cpu_time_by_type, zeek_cpu_time_per_function_type_seconds, labels);
+            AttachCounter(metrics.cpu_time_by_script, zeek_cpu_time_per_script_seconds, {{"script", func->GetLocationInfo()->filename}});
+
+            // Now we add our metadata, for the counters with the name and caller label(s)
+            labels.insert({"name", func->Name()});
+
+            if ( entry.new_histogram )
+                metrics.duration->histogram = &zeek_function_duration_seconds.Add(labels, LatencyBuckets::Boundaries());
+
+            if ( entry.caller != NO_CALLER )
+                labels.insert({"function_caller", func_names[entry.caller]});
+
+            AttachCounter(metrics.calls, zeek_function_calls_total, labels);
+            AttachCounter(metrics.cpu_time, zeek_cpu_time_per_function_seconds, labels);
+            AttachCounter(metrics.absolute_cpu_time, zeek_absolute_cpu_time_per_function_seconds, labels);
+        }
+
+        zeek::Unref(const_cast<zeek::Func*>(func));
+    }
+
+    unsymbolized.clear();
 }
 
-void Plugin::AddlArgumentPopulation(const char * name, zeek::Args* args, std::map<std::string, std::string>& labels) {
-    int arg_offset = -1;
-    int addl_offset = -1;
+Plugin::HookMetrics& Plugin::ResolveHookMetrics(zeek::plugin::HookType hook, HookHandler handler)
+{
+    HookMetrics& metrics = hook_metrics[hook][handler];
+    if ( metrics.cpu_time )
+        return metrics;
+
+    std::map<std::string, std::string> labels = {{"hook", hook_name(hook)}};
 
-    for (auto & arg_event : arg_events)
+    switch ( handler )
     {
-        if ( strcmp(name, arg_event.first.c_str()) == 0 )
-        {
-            arg_offset = std::get<0>(arg_event.second);
-            addl_offset = std::get<1>(arg_event.second);
+        case HANDLER_OTHER_PLUGIN:
+            labels.insert({"plugin", "unknown"});
+            break;
+        case HANDLER_INNER:
+            labels.insert({{"plugin", plugin_name}, {"handler", "inner"}});
+            break;
+        case HANDLER_OUTER:
+            labels.insert({{"plugin", plugin_name}, {"handler", "outer"}});
+            break;
+        default:
             break;
-        }
     }
 
+    // We only count invocations of the function call hook
+    if ( handler != HANDLER_NONE )
+        metrics.calls = BufferCounter(zeek_hooks_total, labels);
+
+    metrics.cpu_time = BufferCounter(zeek_hook_cpu_time_seconds, labels);
+    return metrics;
+}
+
+void Plugin::AddlArgumentPopulation(const FuncMetrics& metrics, zeek::Args* args, ArgFuncKey& key) {
+    int arg_offset = metrics.arg_offset;
+    int addl_offset = metrics.addl_offset;
+
     if ( arg_offset >= 0  && args->size() > arg_offset && IsString((*args)[arg_offset]->GetType()->Tag()) )
     {
         const char* arg_str = (*args)[arg_offset]->AsString()->CheckString();
-        if ( strlen(arg_str) )
-            labels.insert({"arg", arg_str});
+        if ( *arg_str )
+            key.arg = InternArgValue(key.func, ARG_LABEL, arg_str);
     }
 
     if ( addl_offset >= 0 && args->size() > addl_offset && IsString((*args)[addl_offset]->GetType()->Tag()) )
     {
         const char* addl_str = (*args)[addl_offset]->AsString()->CheckString();
-        if ( strlen(addl_str) )
-            labels.insert({"addl", addl_str});
+        if ( *addl_str )
+            key.addl = InternArgValue(key.func, ADDL_LABEL, addl_str);
+    }
+}
+
+uint32_t Plugin::InternArgValue(const zeek::Func* func, ArgLabel label, const char* value)
+{
+    ArgLabelValues& seen = arg_label_values[{func, label}];
+    auto it = seen.ids.find(value);
+    if ( it != seen.ids.end() )
+        return it->second;
+
+    if ( ! arg_label_limit || seen.ids.size() < arg_label_limit )
+    {
+        uint32_t id;
+        if ( seen.free_ids.empty() )
+        {
+            id = seen.values.size();
+            seen.values.emplace_back(value);
+            seen.refs.push_back(0);
+        }
+        else
+        {
+            id = seen.free_ids.back();
+            seen.free_ids.pop_back();
+            seen.values[id] = value;
+        }
+
+        seen.ids.emplace(seen.values[id], id);
+        return id;
+    }
+
+    if ( ! seen.dropped )
+        seen.dropped = BufferCounter(zeek_dropped_label_values_total, {{"name", func->Name()}, {"label", arg_label_names[label]}});
+
+    seen.dropped->value += 1;
+    return OVERFLOW_ARG_VALUE;
+}
+
+std::string Plugin::ArgValue(const zeek::Func* func, ArgLabel label, uint32_t id) const
+{
+    if ( id == OVERFLOW_ARG_VALUE )
+        return arg_label_overflow;
+
+    return arg_label_values.at({func, label}).values[id];
+}
+
+void Plugin::RetainArgValues(const ArgFuncKey& key)
+{
+    if ( key.arg > OVERFLOW_ARG_VALUE )
+        arg_label_values.at({key.func, ARG_LABEL}).refs[key.arg]++;
+
+    if ( key.addl > OVERFLOW_ARG_VALUE )
+        arg_label_values.at({key.func, ADDL_LABEL}).refs[key.addl]++;
+}
+
+void Plugin::ReleaseArgValues(const ArgFuncKey& key)
+{
+    uint32_t ids[NUM_ARG_LABELS] = {key.arg, key.addl};
+    for ( int label = 0; label < NUM_ARG_LABELS; ++label )
+    {
+        uint32_t id = ids[label];
+        if ( id <= OVERFLOW_ARG_VALUE )
+            continue;
+
+        ArgLabelValues& seen = arg_label_values.at({key.func, static_cast<ArgLabel>(label)});
+        if ( --seen.refs[id] )
+            continue;
+
+        seen.ids.erase(seen.values[id]);
+        seen.values[id].clear();
+        seen.free_ids.push_back(id);
     }
 }
 
@@ -109,202 +1363,538 @@ std::pair<bool, zeek::ValPtr> Plugin::HookFunctionCall(const zeek::Func* func, z
     if ( func == current_func ) {
         return {false, NULL};
     }
-    // Since we're handling the function call, we need to increase the ref count on the arguments
-    //    for ( int i = 0; i < args->size(); ++i )
-    //        zeek::Ref((*args)[i]);
+
+    return (this->*call_handler)(func, frame, args);
+}
+
+// The other per-call options (call path profiling, service costs, exemplars and slow calls) are off by default, and
+// cost a well predicted branch each, so they aren't worth doubling the number of variants for.
+template<bool Lineage, bool ArgLabels, bool Histograms, bool Sampling>
+std::pair<bool, zeek::ValPtr> Plugin::HandleCall(const zeek::Func* func, zeek::detail::Frame* frame, zeek::Args* args)
+{
+    // Without sampling, this is a constant 1, and the multiplications get compiled out.
+    const uint64_t scale = Sampling ? sample_rate : 1;
+
+    // Zeek's own call stack is empty unless a function is running, i.e. when events get dispatched from the event
+    // queue, or the core calls a function directly.
+    bool top_level = zeek::detail::call_stack.empty();
+
+    if ( top_level )
+    {
+        // A function that threw doesn't return through us, so this keeps us in step with Zeek.
+        func_depth = 0;
+
+        // Decide whether we're timing the call tree starting here.
+        time_call_tree = ( enabled_metrics & METRICS_FUNCTION_TIMES ) && ( ! Sampling || SampleCallTree() );
+
+        if ( event_queue_metrics && func->Flavor() == zeek::FUNC_FLAVOR_EVENT )
+            CountDispatchedEvent(func);
+    }
+
+    // If we're not timing this call tree, we only count the call, and let Zeek invoke the function itself.
+    if ( ! time_call_tree )
+    {
+        CountUntimedCall<ArgLabels>(func, args);
+
+        // Our outer post hook still runs, and subtracts the function's duration.
+        invoked_duration = 0.0;
+        return {false, nullptr};
+    }
+
+    // Push our frame. The reference would go stale if a child grows frames, so we look it up again afterwards.
+    uint32_t parent_node = func_depth ? frames[func_depth - 1].path_node : 0;
+    func_depth++;
+    if ( func_depth > frames.size() )
+        frames.resize(frames.size() * 2);
+
+    {
+        CallFrame& call_frame = frames[func_depth - 1];
+        call_frame.children_duration = 0.0;
+        call_frame.func_id = Lineage ? InternFunc(func) : UNKNOWN_CALLER;
+
+        if ( call_path_profiling )
+            call_frame.path_node = ResolveCallPath(parent_node, InternFunc(func));
+    }
 
     // Set our indicators, measure the runtime, and call the function.
     own_handler = true;
     current_func = func;
-    auto start = std::chrono::steady_clock::now();
+    uint64_t start = clock_source.Now();
     zeek::ValPtr result = func->Invoke(args, frame);
-    auto stop = std::chrono::steady_clock::now();
+    uint64_t stop = clock_source.Now();
     current_func = nullptr;
     own_handler = false;
 
-    // We create a new variable, because children will increase this
-    size_t my_func_depth = func_depth;
+    double last_function_duration = clock_source.Microseconds(stop - start);
 
-    std::map<std::string, std::string> labels;
+    // We subtract this in the post hook handler from the duration of the hook.
+    invoked_duration = last_function_duration;
 
-    switch ( func->Flavor() )
+    // Our children added their durations here while we ran.
+    const CallFrame& call_frame = frames[func_depth - 1];
+    double children_duration = call_frame.children_duration;
+
+    // We don't track this for top-level functions, since there's no point.
+    if ( func_depth > 1 )
+        frames[func_depth - 2].children_duration += last_function_duration;
+
+    if ( call_path_profiling )
     {
-        case zeek::FUNC_FLAVOR_FUNCTION:
-            labels = {{"function_type", func->GetKind() ? "built-in function" : "script-land function"}};
-            break;
-        case zeek::FUNC_FLAVOR_EVENT:
-            labels = {{"function_type", "event"}};
-            break;
-        case zeek::FUNC_FLAVOR_HOOK:
-            labels = {{"function_type", "hook"}};
-            break;
-        default:
-            labels = {{"function_type", "unknown"}};
-            break;
+        call_path_nodes[call_frame.path_node].self_time += (last_function_duration - children_duration) * scale;
+        call_paths_changed = true;
+    }
+
+    // Events are dispatched at the top level, so this covers everything they call, without counting anything twice.
+    if ( service_costs && func_depth == 1 && func->Flavor() == zeek::FUNC_FLAVOR_EVENT )
+    {
+        if ( PendingCounter* service = ResolveServiceCounter(args) )
+            service->value += last_function_duration * scale / 1000000.0;
     }
 
-    std::chrono::microseconds duration;
+    uint32_t caller = CurrentCaller();
+    if ( Lineage && caller_top_k && caller > OTHER_CALLER )
+        caller = TrackCaller(call_frame.func_id, caller, last_function_duration);
 
-    auto last_function_duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+    FuncMetrics& metrics = ResolveFuncMetrics(func, caller);
 
-    // We subtract this in the post hook handler from the duration of the hook. We need to add this to a stack
-    // because the child post hook will be called before ours.
-    func_durations.push(last_function_duration);
+    // We keep a running total, without function name & caller labels
+    metrics.calls_by_type->value += 1;
+    metrics.cpu_time_by_script->value += last_function_duration * scale;
+    metrics.cpu_time_by_type->value += (last_function_duration - children_duration) * scale / 1000000.0;
 
-    // We need to measure how long any child functions take.
-    double children_duration = 0.0;
-    // If our vector is larger than our current depth, we have some children we must account for.
-    if ( child_func_durations.size() > ( my_func_depth + 1 ) )
+    if ( Histograms && metrics.duration )
     {
-        children_duration = child_func_durations.back();
-        child_func_durations.pop_back();
+        metrics.duration->buckets[LatencyBuckets::Index(last_function_duration * 1000)] += scale;
+        metrics.duration->sum += last_function_duration * scale / 1000000.0;
+        metrics.duration->dirty = true;
     }
 
-    // We don't track this for top-level functions, since there's no point.
-    if ( my_func_depth )
+    // The argument labels vary by call, so those counters are looked up separately, by their values.
+    FuncMetrics* named = &metrics;
+    if ( ArgLabels )
     {
-        // Initialize this to the right depth
-        while ( child_func_durations.size() <= my_func_depth )
-            child_func_durations.push_back(0.0);
+        ArgFuncKey key = {func, caller, NO_ARG_VALUE, NO_ARG_VALUE};
+        CollectArgLabels(metrics, args, key);
+        if ( key.arg != NO_ARG_VALUE || key.addl != NO_ARG_VALUE )
+            named = &ResolveArgFuncMetrics(key);
+    }
+
+    named->calls->value += 1;
+    named->cpu_time->value += last_function_duration * scale / 1000000.0;
+    named->absolute_cpu_time->value += (last_function_duration - children_duration) * scale / 1000000.0;
+
+    if ( exemplars && last_function_duration > named->slowest_duration )
+        TrackSlowestCall(*named, args, last_function_duration);
+
+    if ( slow_call_threshold > 0 && last_function_duration >= slow_call_threshold && slow_calls.Enabled() )
+        slow_calls.Record({InternFunc(func), CurrentCaller(), static_cast<uint32_t>(func_depth), last_function_duration, zeek::run_state::network_time});
+
+    // We returned, so pop our frame.
+    func_depth--;
+
+    // Everything since the function returned was our own bookkeeping.
+    self_overhead_seconds->value += clock_source.Microseconds(clock_source.Now() - stop) / 1000000.0;
+    return {true, result};
+}
+
+template<bool ArgLabels>
+void Plugin::CountUntimedCall(const zeek::Func* func, zeek::Args* args)
+{
+    // Calls we don't time are always top-level, since we don't see the function return, and thus don't track their children.
+    FuncMetrics& metrics = ResolveFuncMetrics(func, NO_CALLER);
+    metrics.calls_by_type->value += 1;
 
-        child_func_durations[my_func_depth] += last_function_duration.count();
+    FuncMetrics* named = &metrics;
+    if ( ArgLabels )
+    {
+        ArgFuncKey key = {func, NO_CALLER, NO_ARG_VALUE, NO_ARG_VALUE};
+        CollectArgLabels(metrics, args, key);
+        if ( key.arg != NO_ARG_VALUE || key.addl != NO_ARG_VALUE )
+            named = &ResolveArgFuncMetrics(key);
     }
 
-    // We keep a running total, without function name & caller labels
-    zeek_function_calls_total.Add(labels).Increment();
-    zeek_cpu_time_per_script_seconds.Add({{"script", func->GetLocationInfo()->filename}}).Increment(last_function_duration.count());
-    zeek_cpu_time_per_function_type_seconds.Add(labels).Increment((last_function_duration.count() - children_duration) / 1000000.0);
+    named->calls->value += 1;
+}
+
+std::pair<bool, zeek::ValPtr> Plugin::PassCall(const zeek::Func* func, zeek::detail::Frame* frame, zeek::Args* args)
+{
+    return {false, NULL};
+}
+
+template<size_t... Variants>
+constexpr std::array<Plugin::CallHandler, sizeof...(Variants)> Plugin::CallHandlers(std::index_sequence<Variants...>)
+{
+    return {{&Plugin::HandleCall<( Variants & 8 ) != 0, ( Variants & 4 ) != 0, ( Variants & 2 ) != 0, ( Variants & 1 ) != 0>...}};
+}
+
+void Plugin::SelectCallHandler()
+{
+    // Every variant, indexed by its options as bits, in the order of HandleCall()'s parameters.
+    static constexpr auto handlers = CallHandlers(std::make_index_sequence<16>());
+
+    bool lineage = zeek::BifConst::Exporter::track_lineage;
+    bool arg_labels = ! arg_events->empty();
+    bool histograms = function_histograms;
+    bool sampling = sample_rate > 1;
 
-    // Now we add our metadata and store it again, with the label(s)
-    const char * name = func->Name();
-    labels.insert({"name", func->Name()});
+    call_handler = handlers[lineage << 3 | arg_labels << 2 | histograms << 1 | sampling];
+}
+
+void Plugin::CollectArgLabels(FuncMetrics& metrics, zeek::Args* args, ArgFuncKey& key)
+{
+    const zeek::Func* func = key.func;
 
     // Grab some values for select events. Only bother if we have arguments, and if it's an event
-    if ( args->size() && func->Flavor() == zeek::FUNC_FLAVOR_EVENT )
+    if ( ! args->size() || func->Flavor() != zeek::FUNC_FLAVOR_EVENT )
+        return;
+
+    if ( metrics.arg_events_version != arg_events_version )
     {
-        start = std::chrono::steady_clock::now();
-        AddlArgumentPopulation(name, args, labels);
-        stop = std::chrono::steady_clock::now();
-        duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-        zeek_hook_cpu_time_seconds.Add({{"plugin", plugin_name}, {"hook", "AddlArgumentPopulation"}}).Increment(duration.count() / 1000000.0);
+        auto it = arg_events->find(func->Name());
+        metrics.arg_offset = it != arg_events->end() ? std::get<0>(it->second) : -1;
+        metrics.addl_offset = it != arg_events->end() ? std::get<1>(it->second) : -1;
+        metrics.arg_events_version = arg_events_version;
     }
 
-    if ( lineage.size() > 1) {
-        // We're lineage[lineage.size()-1], parent is size()-2
-	labels.insert({"function_caller", lineage[lineage.size() - 2]});
+    // Most events aren't ones we collect arguments for, so this is as far as they get.
+    if ( metrics.arg_offset < 0 && metrics.addl_offset < 0 )
+        return;
+
+    uint64_t start = clock_source.Now();
+    AddlArgumentPopulation(metrics, args, key);
+    uint64_t stop = clock_source.Now();
+    addl_arg_hook_cpu_time_seconds->value += clock_source.Microseconds(stop - start) / 1000000.0;
+}
+
+std::map<std::string, std::string> Plugin::ArgLabels(const ArgFuncKey& key)
+{
+    std::map<std::string, std::string> labels = {{"function_type", FunctionType(key.func)}, {"name", key.func->Name()}};
+    if ( key.arg != NO_ARG_VALUE )
+        labels.insert({arg_label_names[ARG_LABEL], ArgValue(key.func, ARG_LABEL, key.arg)});
+    if ( key.addl != NO_ARG_VALUE )
+        labels.insert({arg_label_names[ADDL_LABEL], ArgValue(key.func, ADDL_LABEL, key.addl)});
+    if ( key.caller != NO_CALLER )
+        labels.insert({"function_caller", func_names[key.caller]});
+
+    return labels;
+}
+
+void Plugin::UpdateArgFunction(const std::string& name, int arg, int addl)
+{
+    auto updated = std::make_shared<ArgEventTable>(*arg_events);
+    if ( arg >= 0 || addl >= 0 )
+        (*updated)[name] = std::make_tuple(arg, addl);
+    else
+        updated->erase(name);
+
+    SwapArgEvents(std::move(updated));
+}
+
+void Plugin::SetArgFunctions(zeek::TableVal* functions)
+{
+    auto updated = std::make_shared<ArgEventTable>();
+
+    auto names = functions->ToPureListVal();
+    for ( int i = 0; i < names->Length(); ++i )
+    {
+        const zeek::ValPtr& name = names->Idx(i);
+        auto offsets = functions->FindOrDefault(name)->AsRecordVal();
+        int arg = offsets->GetFieldOrDefault("arg")->AsInt();
+        int addl = offsets->GetFieldOrDefault("addl")->AsInt();
+        if ( arg >= 0 || addl >= 0 )
+            updated->emplace(name->AsString()->CheckString(), std::make_tuple(arg, addl));
     }
-    zeek_function_calls_total.Add(labels).Increment();
-    zeek_cpu_time_per_function_seconds.Add(labels).Increment(last_function_duration.count() / 1000000.0);
-    zeek_absolute_cpu_time_per_function_seconds.Add(labels).Increment((last_function_duration.count() - children_duration) / 1000000.0);
 
-    // We update the list of functions we want some arguments for.
-    if ( strcmp(name, "Exporter::update_arg_functions") == 0 && args->size() == 3 )
+    SwapArgEvents(std::move(updated));
+}
+
+void Plugin::SwapArgEvents(std::shared_ptr<const ArgEventTable> updated)
+{
+    // The table is never changed in place, so a lookup only ever sees the old one, or the new one.
+    arg_events = std::move(updated);
+    arg_events_version++;
+
+    // Without any arg functions, calls skip looking for them. Before InitPostScript(), calls aren't handled at all.
+    if ( call_handler != &Plugin::PassCall )
+        SelectCallHandler();
+}
+
+bool Plugin::SampleCallTree()
+{
+    if ( sample_rate <= 1 )
+        return true;
+
+    // xorshift64, which is plenty random for this, and doesn't fall into step with periodic event patterns the way
+    // a simple 1-in-N counter could.
+    sample_state ^= sample_state << 13;
+    sample_state ^= sample_state >> 7;
+    sample_state ^= sample_state << 17;
+    return sample_state % sample_rate == 0;
+}
+
+bool Plugin::HookQueueEvent(zeek::Event* event)
+{
+    events_since_drain++;
+
+    // Events without a local handler never get dispatched to a function, so there's nothing to match them up with.
+    const zeek::FuncPtr& handler = event->Handler()->GetFunc();
+    if ( handler )
     {
-        int arg_val = (*args)[1]->AsInt();
-        int addl_val = (*args)[2]->AsInt();
-        if ( arg_val >= 0 || addl_val >= 0 )
-            arg_events.insert({std::string((*args)[0]->AsString()->CheckString()), std::make_tuple(arg_val, addl_val)});
+        std::deque<uint64_t>& queued = queued_events[handler.get()];
+        if ( queued.size() < max_queued_per_handler )
+            queued.push_back(clock_source.Now());
     }
-    return {true, result};
+
+    // We only watch the queue, we don't take the event.
+    return false;
+}
+
+void Plugin::HookDrainEvents()
+{
+    if ( ! events_since_drain )
+        return;
+
+    event_queue_depth->buckets[CountBuckets::Index(events_since_drain)] += 1;
+    event_queue_depth->sum += events_since_drain;
+    event_queue_depth->dirty = true;
+    events_since_drain = 0;
+}
+
+void Plugin::CountDispatchedEvent(const zeek::Func* func)
+{
+    auto it = queued_events.find(func);
+    if ( it == queued_events.end() || it->second.empty() )
+        return;
+
+    // Events that get dispatched without being queued (e.g. with EventMgr::Dispatch()) would take another event's
+    // timestamp, but those are rare.
+    uint64_t waited = clock_source.Now() - it->second.front();
+    it->second.pop_front();
+
+    double waited_us = clock_source.Microseconds(waited);
+    event_queue_latency->buckets[LatencyBuckets::Index(waited_us * 1000)] += 1;
+    event_queue_latency->sum += waited_us / 1000000.0;
+    event_queue_latency->dirty = true;
 }
 
 bool Plugin::HookLogWrite(const std::string& writer, const std::string& filter, const zeek::logging::WriterBackend::WriterInfo& info, int num_fields, const zeek::threading::Field* const* fields, zeek::threading::Value** vals)
 {
+    LogMetrics& metrics = ResolveLogMetrics(writer, filter, info);
+    metrics.writes->value += 1;
+
+    // Only estimate the size of 1 in log_write_bytes_sample_rate lines, and scale it up.
+    if ( metrics.bytes && --metrics.bytes_countdown == 0 )
+    {
+        metrics.bytes_countdown = log_write_bytes_sample_rate;
+
+        // One separator after each field, counting the newline.
+        uint64_t bytes = num_fields;
+        for ( int i = 0; i < num_fields; ++i )
+            bytes += ValueSize(vals[i]);
+
+        metrics.bytes->value += bytes * log_write_bytes_sample_rate;
+        metrics.fields->value += num_fields * log_write_bytes_sample_rate;
+    }
+
+    return true;
+}
+
+// The number of decimal digits in value.
+static uint64_t Digits(uint64_t value)
+{
+    uint64_t digits = 1;
+    while ( value >= 10 )
+    {
+        value /= 10;
+        digits++;
+    }
+
+    return digits;
+}
+
+uint64_t Plugin::ValueSize(const zeek::threading::Value* val)
+{
+    // This is an estimate of how much space the value takes up in the ASCII writer's output, without actually
+    // formatting it. Numbers get their exact width, addresses a typical one, and strings aren't checked for escaping.
+    if ( ! val->present )
+        return 1; // "-"
+
+    switch ( val->type )
+    {
+        case zeek::TYPE_BOOL:
+            return 1;
+
+        case zeek::TYPE_COUNT:
+            return Digits(val->val.uint_val);
+
+        case zeek::TYPE_INT:
+            return val->val.int_val < 0 ? Digits(-(uint64_t) val->val.int_val) + 1 : Digits(val->val.int_val);
+
+        case zeek::TYPE_PORT:
+            return Digits(val->val.port_val.port);
+
+        case zeek::TYPE_ADDR:
+            return val->val.addr_val.family == IPv4 ? typical_ipv4_width : typical_ipv6_width;
+
+        case zeek::TYPE_SUBNET:
+            return ( val->val.subnet_val.prefix.family == IPv4 ? typical_ipv4_width : typical_ipv6_width ) + 1 +
+                    Digits(val->val.subnet_val.length);
+
+        case zeek::TYPE_DOUBLE:
+        case zeek::TYPE_TIME:
+        case zeek::TYPE_INTERVAL:
+        {
+            // Printed with 6 decimals, e.g. 1600000000.123456 for a time.
+            double magnitude = std::fabs(val->val.double_val);
+            uint64_t integer = magnitude < 1e19 ? (uint64_t) magnitude : UINT64_MAX;
+            return Digits(integer) + 7 + ( val->val.double_val < 0 );
+        }
+
+        case zeek::TYPE_STRING:
+        case zeek::TYPE_ENUM:
+        case zeek::TYPE_FILE:
+        case zeek::TYPE_FUNC:
+            return val->val.string_val.length ? val->val.string_val.length : empty_field_width;
+
+        case zeek::TYPE_PATTERN:
+            return strlen(val->val.pattern_text_val);
+
+        case zeek::TYPE_TABLE:
+        case zeek::TYPE_VECTOR:
+        {
+            const auto& elements = val->type == zeek::TYPE_TABLE ? val->val.set_val : val->val.vector_val;
+            if ( ! elements.size )
+                return empty_field_width;
+
+            // The elements, separated by commas.
+            uint64_t size = elements.size - 1;
+            for ( int64_t i = 0; i < elements.size; ++i )
+                size += ValueSize(elements.vals[i]);
+            return size;
+        }
+
+        default:
+            return 8;
+    }
+}
+
+Plugin::LogMetrics& Plugin::ResolveLogMetrics(const std::string& writer, const std::string& filter, const zeek::logging::WriterBackend::WriterInfo& info)
+{
+    LogMetrics& metrics = log_metrics[{&info, &filter}];
+
+    // The writer info may have been freed, and its address reused by another writer, so double check that it's still
+    // the same log.
+    if ( metrics.writes && metrics.path == info.path && metrics.writer == writer
+         && ( ! info.path || metrics.path_copy == info.path ) )
+        return metrics;
+
     std::map<std::string, std::string> labels = {{"type", "log_write"}, {"writer", writer}, {"filter", filter}};
     if ( info.path )
         labels.insert({"path", info.path});
 
-    zeek_log_writes_total.Add(labels).Increment();
-    return true;
+    // The counters we had are released after resolving the new ones, so that a series both are for isn't removed.
+    LogMetrics replaced = metrics;
+
+    metrics.path = info.path;
+    metrics.path_copy = info.path ? info.path : "";
+    metrics.writer = writer;
+    metrics.writes = BufferCounter(zeek_log_writes_total, labels);
+
+    if ( log_write_bytes )
+    {
+        labels.erase("type");
+        metrics.bytes = BufferCounter(zeek_log_write_bytes_total, labels);
+        metrics.fields = BufferCounter(zeek_log_write_fields_total, labels);
+        metrics.bytes_countdown = 1;
+    }
+
+    if ( replaced.writes )
+    {
+        ReleaseCounter(replaced.writes);
+        if ( replaced.bytes )
+        {
+            ReleaseCounter(replaced.bytes);
+            ReleaseCounter(replaced.fields);
+        }
+    }
+
+    return metrics;
 }
 
 
 void Plugin::MetaHookPre(zeek::plugin::HookType hook, const zeek::plugin::HookArgumentList& args)
 {
-    // This hook is our most common entrypoint, so we track overall CPU time here
-    zeek_total_cpu_time_seconds.Add({{"type", "cpu_time"}}).Set((double) clock()/CLOCKS_PER_SEC);
-
+    // These are only enabled for the plugin hook metrics. The call stack is tracked in HookFunctionCall.
     if ( hook == zeek::plugin::HOOK_LOG_WRITE )
-        log_hook_start = std::chrono::steady_clock::now();
+        log_hook_start = clock_source.Now();
     else if ( hook == zeek::plugin::HOOK_CALL_FUNCTION )
     {
-        func_hook_starts.push(std::chrono::steady_clock::now());
-        const zeek::Func* func = args.front().AsFunc();
-        if ( func != current_func )
+        uint64_t now = clock_source.Now();
+        if ( args.front().AsFunc() != current_func )
         {
-            // Increase the depth, and append it to the lineage vector
-            func_depth++;
-            if(zeek::BifConst::Exporter::track_lineage){
+            // As in HookFunctionCall, a function that threw leaves its start behind.
+            if ( zeek::detail::call_stack.empty() )
+                outer_hook_starts.clear();
 
-                int ns = strlen(func->Name());
-                char* name_copy;
-                name_copy = new char[ns + 1];
-                memcpy(name_copy, func->Name(), ns);
-                name_copy[ns] = '\0';
-                lineage.push_back(name_copy);
-           }else{
-                lineage.push_back(func_caller_unknown);
-           }
+            outer_hook_starts.push_back(now);
         }
+        else
+            inner_hook_start = now;
     }
     else
-        other_hook_start = std::chrono::steady_clock::now();
+        other_hook_start = clock_source.Now();
 }
 
 void Plugin::MetaHookPost(zeek::plugin::HookType hook, const zeek::plugin::HookArgumentList& args, zeek::plugin::HookArgument result)
 {
     // Grab the timestamp first, for increased accuracy
-    auto hook_stop = std::chrono::steady_clock::now();
-    std::map<std::string, std::string> labels = {{"hook", hook_name(hook)}};
+    uint64_t hook_stop = clock_source.Now();
 
     // The function call timing is rather complex, due to recursion. Handle the easy log writes first.
     if ( hook == zeek::plugin::HOOK_LOG_WRITE )
     {
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(hook_stop - log_hook_start);
-        zeek_hook_cpu_time_seconds.Add(labels).Increment(duration.count() / 1000000.0);
+        double duration = clock_source.Microseconds(hook_stop - log_hook_start);
+        ResolveHookMetrics(hook, HANDLER_NONE).cpu_time->value += duration / 1000000.0;
         return;
     }
 
     // This is a hook we don't handle, but someone else might
     if ( hook != zeek::plugin::HOOK_CALL_FUNCTION )
     {
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(hook_stop - other_hook_start);
-        zeek_hook_cpu_time_seconds.Add(labels).Increment(duration.count() / 1000000.0);
+        double duration = clock_source.Microseconds(hook_stop - other_hook_start);
+        ResolveHookMetrics(hook, HANDLER_NONE).cpu_time->value += duration / 1000000.0;
         return;
     }
 
-    // Grab the last function hook start time off the stack, and calculate the duration
-    double duration = std::chrono::duration_cast<std::chrono::microseconds>(hook_stop - func_hook_starts.top()).count();
-    func_hook_starts.pop();
-
+    HookHandler handler;
+    double duration;
     const zeek::Func* func = args.front().AsFunc();
     // This is another plugin's hook handler
     if ( ! own_handler && func == current_func)
     {
-        labels.insert({"plugin", "unknown"});
+        handler = HANDLER_OTHER_PLUGIN;
+        duration = clock_source.Microseconds(hook_stop - inner_hook_start);
     }
     else {
         if ( func == current_func )
         {
             // This is our inner handler. The next handler to run will not be ours.
             own_handler = false;
-            labels.insert({{"plugin", plugin_name}, {"handler", "inner"}});
+            handler = HANDLER_INNER;
+            duration = clock_source.Microseconds(hook_stop - inner_hook_start);
         }
         else
         {
             // Outer handler
-            labels.insert({{"plugin", plugin_name}, {"handler", "outer"}});
+            handler = HANDLER_OUTER;
 
             // The outer handler duration is the duration of the hook, minus the execution time of the function.
-            duration -= func_durations.top().count();
-            func_durations.pop();
-
-            // We returned, so adjust the lineage and function depth to reflect that.
-            lineage.pop_back();
-            func_depth--;
+            duration = clock_source.Microseconds(hook_stop - outer_hook_starts.back()) - invoked_duration;
+            outer_hook_starts.pop_back();
         }
     }
 
-    zeek_hooks_total.Add(labels).Increment();
-    zeek_hook_cpu_time_seconds.Add(labels).Increment(duration / 1000000);
+    HookMetrics& metrics = ResolveHookMetrics(hook, handler);
+    metrics.calls->value += 1;
+    metrics.cpu_time->value += duration / 1000000;
 }
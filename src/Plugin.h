@@ -1,16 +1,31 @@
 #pragma once
 
+#include <array>
 #include <chrono>
+#include <deque>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 
 #include <prometheus/counter.h>
 #include <prometheus/exposer.h>
 #include <prometheus/family.h>
 #include <prometheus/gauge.h>
+#include <prometheus/histogram.h>
 #include <prometheus/registry.h>
 
 #include <zeek/plugin/Plugin.h>
+#include <zeek/Val.h>
 #include "zeek_exporter.bif.h"
 
+#include "Clock.h"
+#include "HeavyHitters.h"
+#include "LatencyHistogram.h"
+#include "Pusher.h"
+#include "SlowCallLog.h"
+#include "SnapshotServer.h"
+
 namespace plugin {
     namespace ESnet_Zeek_Exporter {
 
@@ -20,28 +35,324 @@ namespace plugin {
             Plugin();
             void InitPreScript() override;
             void InitPostScript() override;
+            void Done() override;
+
+            // Publishes everything we've buffered since the last flush to the registry.
+            void FlushMetrics();
+
+            // With Exporter::cluster_aggregation, returns the counter increments since the last call, for shipping
+            // to the manager, as an Exporter::MetricDeltas. This is empty on the manager itself.
+            zeek::VectorValPtr TakeDeltas();
+
+            // With Exporter::call_path_profiling, the time spent in each call path, in the folded stack format used by
+            // flamegraph.pl.
+            std::string FoldedStacks() const;
+
+            // With Exporter::slow_call_threshold, the last calls that took longer than it, as JSON ("json"), or in the
+            // Chrome trace event format ("chrome").
+            std::string SlowCalls(const std::string& format) const;
+
+            // Adds the increments shipped to us by another node to our own counters.
+            void MergeDeltas(const zeek::VectorVal* deltas);
+
+            // Sets the arg and addl offsets for one function, or stops collecting its arguments if both are negative.
+            void UpdateArgFunction(const std::string& name, int arg, int addl);
+
+            // Replaces all of the functions we collect arguments for with an Exporter::ArgFunctions.
+            void SetArgFunctions(zeek::TableVal* functions);
+
+            // Publishes the process' memory use, and measures some more of the global tables and sets. This is called
+            // every Exporter::memory_interval.
+            void SampleMemory();
 
         protected:
             // Overridden from plugin::Plugin.
 	        zeek::plugin::Configuration Configure() override;
 	        std::pair<bool, zeek::ValPtr> HookFunctionCall(const zeek::Func* func, zeek::detail::Frame* frame, zeek::Args* args) override;
+	        bool HookQueueEvent(zeek::Event* event) override;
+	        void HookDrainEvents() override;
 	        bool HookLogWrite(const std::string& writer, const std::string& filter, const zeek::logging::WriterBackend::WriterInfo& info, int num_fields, const zeek::threading::Field* const* fields, zeek::threading::Value** vals) override;
 	        void MetaHookPre(zeek::plugin::HookType hook, const zeek::plugin::HookArgumentList& args) override;
 	        void MetaHookPost(zeek::plugin::HookType hook, const zeek::plugin::HookArgumentList& args, zeek::plugin::HookArgument result) override;
 
         private:
-	        void AddlArgumentPopulation(const char * name, zeek::Args* args, std::map<std::string, std::string>& labels);
+            // HookFunctionCall's work, compiled for each combination of the options that are checked on every call, so
+            // that the ones which are off cost nothing. SelectCallHandler() picks the variant for our settings, in
+            // InitPostScript(), and again whenever the arg functions change.
+            template<bool Lineage, bool ArgLabels, bool Histograms, bool Sampling>
+            std::pair<bool, zeek::ValPtr> HandleCall(const zeek::Func* func, zeek::detail::Frame* frame, zeek::Args* args);
+            typedef std::pair<bool, zeek::ValPtr> (Plugin::*CallHandler)(const zeek::Func* func, zeek::detail::Frame* frame, zeek::Args* args);
+            template<size_t... Variants>
+            static constexpr std::array<CallHandler, sizeof...(Variants)> CallHandlers(std::index_sequence<Variants...>);
+            void SelectCallHandler();
+            // Scripts call functions while they're still being parsed, e.g. getenv() in an @if, before
+            // InitPostScript() has set up the counters HandleCall() adds to. Until then, calls are just passed on.
+            std::pair<bool, zeek::ValPtr> PassCall(const zeek::Func* func, zeek::detail::Frame* frame, zeek::Args* args);
+            CallHandler call_handler = &Plugin::PassCall;
+
+	        template<bool ArgLabels>
+	        void CountUntimedCall(const zeek::Func* func, zeek::Args* args);
+	        void CountDispatchedEvent(const zeek::Func* func);
+	        bool SampleCallTree();
+
+            // Which counter a PendingCounter is for, so that we can ship its increments to the manager.
+            struct CounterSeries
+            {
+                prometheus::Family<prometheus::Counter>* family;
+                std::vector<std::string> labels;
+                // What we've flushed, but not shipped yet.
+                double unshipped;
+            };
+
+            // A counter, along with the amount we've added to it since the last flush. The counter may not be set until
+            // the next flush, see DeferCounter().
+            struct PendingCounter
+            {
+                prometheus::Counter* counter;
+                double value;
+                CounterSeries* series;
+                // How many of our caches hold this, and the last flush that had something to add to it, for
+                // Exporter::series_ttl.
+                uint32_t refs;
+                uint64_t updated;
+            };
+
+            // A histogram, along with the observations we've added to it since the last flush. The histogram may not be
+            // set until the next flush.
+            struct PendingHistogram
+            {
+                prometheus::Histogram* histogram;
+                // This is LatencyBuckets::num_buckets, unless the histogram has fewer buckets.
+                size_t num_buckets;
+                uint64_t buckets[LatencyBuckets::num_buckets];
+                double sum;
+                bool dirty;
+            };
+
+            // The counters a single function call updates, resolved once per function and caller.
+            struct FuncMetrics
+            {
+                PendingCounter* calls_by_type;
+                PendingCounter* cpu_time_by_type;
+                PendingCounter* cpu_time_by_script;
+                PendingCounter* calls;
+                PendingCounter* cpu_time;
+                PendingCounter* absolute_cpu_time;
+
+                // Only set if Exporter::function_histograms is enabled. This is shared by all callers of the function.
+                PendingHistogram* duration;
+
+                // The offsets of the arguments we put in the "arg" and "addl" labels, or -1. These are looked up
+                // in arg_events the first time we see the function, and again whenever arg_events changes.
+                int arg_offset;
+                int addl_offset;
+                uint32_t arg_events_version;
+
+                // With Exporter::exemplars, the slowest call since the last flush: how long it took in microseconds,
+                // when it returned, and its connection's uid, if its first argument was a connection.
+                double slowest_duration = 0.0;
+                double slowest_time = 0.0;
+                std::string slowest_uid;
+            };
+
+            // The counters for a log, resolved once per log writer and filter.
+            struct LogMetrics
+            {
+                PendingCounter* writes = nullptr;
+
+                // Only set if Exporter::log_write_bytes is enabled.
+                PendingCounter* bytes = nullptr;
+                PendingCounter* fields = nullptr;
+                uint64_t bytes_countdown = 0;
+
+                // What we resolved the counters for, to make sure the writer info wasn't replaced.
+                const char* path = nullptr;
+                std::string path_copy;
+                std::string writer;
+            };
+
+            struct LogKeyHash
+            {
+                size_t operator()(const std::pair<const void*, const void*>& key) const
+                    { return std::hash<const void*>()(key.first) ^ (std::hash<const void*>()(key.second) << 1); }
+            };
+
+            // Which of our handlers (if any) a hook measurement belongs to. These map to the "plugin" and "handler" labels.
+            enum HookHandler { HANDLER_NONE, HANDLER_OTHER_PLUGIN, HANDLER_INNER, HANDLER_OUTER, NUM_HOOK_HANDLERS };
+
+            // The counters for a plugin hook, resolved once per hook type and handler.
+            struct HookMetrics
+            {
+                PendingCounter* calls;
+                PendingCounter* cpu_time;
+            };
+
+            // A function, and who called it, by interned ID.
+            struct FuncCallerKey
+            {
+                const zeek::Func* func;
+                uint32_t caller;
+
+                bool operator==(const FuncCallerKey& other) const
+                    { return func == other.func && caller == other.caller; }
+            };
+
+            struct FuncCallerKeyHash
+            {
+                size_t operator()(const FuncCallerKey& key) const
+                    { return std::hash<const void*>()(key.func) ^ (std::hash<uint32_t>()(key.caller) << 1); }
+            };
+
+            // As above, along with the interned IDs of the call's arg and addl label values.
+            struct ArgFuncKey
+            {
+                const zeek::Func* func;
+                uint32_t caller;
+                uint32_t arg;
+                uint32_t addl;
+
+                bool operator==(const ArgFuncKey& other) const
+                    { return func == other.func && caller == other.caller && arg == other.arg && addl == other.addl; }
+            };
+
+            struct ArgFuncKeyHash
+            {
+                size_t operator()(const ArgFuncKey& key) const
+                    { return FuncCallerKeyHash()({key.func, key.caller}) ^ (std::hash<uint64_t>()(uint64_t(key.arg) << 32 | key.addl) << 2); }
+            };
+
+            // The IDs of callers which aren't interned functions.
+            enum { NO_CALLER = 0, UNKNOWN_CALLER = 1, OTHER_CALLER = 2 };
+
+            PendingCounter* BufferCounter(prometheus::Family<prometheus::Counter>& family, const std::map<std::string, std::string>& labels);
+            // A PendingCounter whose counter (and labels) get filled in later, with AttachCounter().
+            PendingCounter* DeferCounter(prometheus::Family<prometheus::Counter>& family);
+            PendingCounter* NewPendingCounter();
+            // Gives up a cache's hold on a counter. Once nothing holds it, it's removed from its family.
+            void ReleaseCounter(PendingCounter* pending);
+            bool SeriesIdle(const PendingCounter* pending) const;
+            void EvictIdleSeries();
+            void AttachCounter(PendingCounter* pending, prometheus::Family<prometheus::Counter>& family, const std::map<std::string, std::string>& labels);
+            bool FamilyEnabled(const prometheus::Family<prometheus::Counter>& family) const;
+            PendingHistogram* BufferHistogram(size_t num_buckets = LatencyBuckets::num_buckets);
+            uint32_t InternFunc(const zeek::Func* func);
+            uint32_t CurrentCaller() const;
+            uint32_t TrackCaller(uint32_t func_id, uint32_t caller, double duration);
+            void PromoteTopCallers();
+            uint32_t ResolveCallPath(uint32_t parent, uint32_t func_id);
+            PendingCounter* ResolveServiceCounter(zeek::Args* args);
+            void TrackSlowestCall(FuncMetrics& metrics, zeek::Args* args, double duration);
+            void PublishExemplars();
+            FuncMetrics& ResolveFuncMetrics(const zeek::Func* func, uint32_t caller);
+            FuncMetrics& ResolveArgFuncMetrics(const ArgFuncKey& key);
+            std::map<std::string, std::string> ArgLabels(const ArgFuncKey& key);
+            void DeferSymbolization(const zeek::Func* func, uint32_t caller, const ArgFuncKey* arg_key, FuncMetrics* metrics, bool new_histogram);
+            void SymbolizeFuncMetrics();
+            HookMetrics& ResolveHookMetrics(zeek::plugin::HookType hook, HookHandler handler);
+            void ConfigureEnabledMetrics();
+            void SampleCPUTime();
+            void SampleMsgThreads();
+            void WalkGlobals();
+            void PublishGlobalSizes();
+            static bool IsClusterManager(const char* node);
+            static uint64_t ValueSize(const zeek::threading::Value* val);
+            // What ValueSize() assumes for values whose width it doesn't work out, e.g. 10.1.20.30, and for empty
+            // strings and containers, which the ASCII writer prints as "(empty)".
+            static constexpr uint64_t typical_ipv4_width = 12;
+            static constexpr uint64_t typical_ipv6_width = 24;
+            static constexpr uint64_t empty_field_width = 7;
+            LogMetrics& ResolveLogMetrics(const std::string& writer, const std::string& filter, const zeek::logging::WriterBackend::WriterInfo& info);
+
+	        void AddlArgumentPopulation(const FuncMetrics& metrics, zeek::Args* args, ArgFuncKey& key);
+	        // The labels AddlArgumentPopulation() can add, in arg_label_names.
+	        enum ArgLabel { ARG_LABEL, ADDL_LABEL, NUM_ARG_LABELS };
+	        uint32_t InternArgValue(const zeek::Func* func, ArgLabel label, const char* value);
+	        std::string ArgValue(const zeek::Func* func, ArgLabel label, uint32_t id) const;
+	        void RetainArgValues(const ArgFuncKey& key);
+	        void ReleaseArgValues(const ArgFuncKey& key);
+	        void CollectArgLabels(FuncMetrics& metrics, zeek::Args* args, ArgFuncKey& key);
 
             const char* plugin_name = "ESnet::Zeek_Exporter";
             const char* node_name = getenv("CLUSTER_NODE") ? getenv("CLUSTER_NODE") : "standalone";
 
             // The current function depth. Used for time calculation and lineage.
             size_t func_depth = 0;
-            // Track our parents
-            std::vector<const char *> lineage;
+
+            // What we track for each timed function on the call stack, while HookFunctionCall invokes it.
+            struct CallFrame
+            {
+                // The durations of the calls this one made, in microseconds, so that we can tell its "absolute" time.
+                double children_duration;
+
+                // The function's interned ID, for lineage. If we're not tracking lineage, this is UNKNOWN_CALLER.
+                uint32_t func_id;
+
+                // Where we are in call_path_nodes, if we're profiling call paths.
+                uint32_t path_node;
+            };
+
+            // Indexed by func_depth - 1. This is enough for all but pathological recursion. Past that, it grows, which
+            // is the only time we allocate here.
+            static constexpr size_t initial_call_depth = 256;
+            std::vector<CallFrame> frames = std::vector<CallFrame>(initial_call_depth);
+
+            // For the plugin hook metrics, when each of our outer hooks on the stack started, and when the latest inner
+            // hook (or another plugin's hook) started. The inner hooks always finish before the function runs, so they
+            // don't nest.
+            std::vector<uint64_t> outer_hook_starts;
+            uint64_t inner_hook_start = 0;
+
+            // The duration of the call HookFunctionCall last returned from, in microseconds (0 if Zeek invoked it),
+            // so the outer hook's own duration can be told apart.
+            double invoked_duration = 0.0;
 	    const char* func_caller_unknown = "Unknown";
+	    const char* func_caller_other = "Other";
+
+            // With Exporter::caller_top_k, the (function, caller) pairs' CPU time goes into a fixed size sketch, and only
+            // the pairs in its top K as of the last flush get their own series. The rest are counted under OTHER_CALLER.
+            // The sketch decays every flush, with a half-life of caller_sketch_half_life seconds, so the top K follows
+            // what's busy now.
+            uint64_t caller_top_k = 0;
+            static constexpr uint64_t caller_sketch_oversize = 4;
+            static constexpr double caller_sketch_half_life = 300.0;
+            double caller_sketch_decay = 1.0;
+            HeavyHitters caller_sketch;
+            std::unordered_set<uint64_t> promoted_callers;
+
+            // With Exporter::call_path_profiling, every call path we've seen, as a tree of interned function IDs, along
+            // with the time spent in each path's last function itself (in microseconds). Node 0 is the root, and
+            // call_path_children maps a node and a function ID to the node for that child.
+            struct CallPathNode
+            {
+                uint32_t parent;
+                uint32_t func_id;
+                double self_time;
+            };
+
+            bool call_path_profiling = false;
+            static constexpr size_t max_call_path_nodes = 100000;
+            std::vector<CallPathNode> call_path_nodes = {{0, NO_CALLER, 0.0}};
+            std::unordered_map<uint64_t, uint32_t> call_path_children;
+
+            // How often /flamegraph gets rendered again, in seconds, and whether any time's been added since it was.
+            static constexpr double flamegraph_interval = 10.0;
+            uint64_t flamegraph_every_flushes = 1;
+            bool call_paths_changed = false;
+
+            // Each function we've seen in the lineage gets its name stored here once, indexed by its ID. This way we
+            // don't copy names around on every call, and the names stay valid even if the function goes away.
+            std::unordered_map<const zeek::Func*, uint32_t> func_ids;
+            std::vector<std::string> func_names = {"", func_caller_unknown, func_caller_other};
+
+            // With Exporter::slow_call_threshold (in microseconds here), the last calls that took longer than it, and
+            // how many had been recorded when we last published them.
+            double slow_call_threshold = 0.0;
+            SlowCallLog slow_calls;
+            uint64_t published_slow_calls = 0;
 
             // In order to time how long function execution takes, we call the function ourselves (returning false to the plugin manager to indicate that we've taken over responsibility).
+            // Zeek has no hook for when a function returns (the meta hooks only wrap the hook calls, which finish
+            // before the function runs), so this is the only way to see it. Calls we don't time are left to Zeek.
             // However, we want to provide other plugins a chance to run, so when the function gets called, hooks get executed again. To prevent recursing, we need to track some state
             // to tell if we're in our "outer" handler, or the "inner" handler.
 
@@ -51,22 +362,41 @@ namespace plugin {
             // This determines whether it's our plugin running, or someone else's.
             bool own_handler = true;
 
-            // These are for measuring the runtimes of hooks. We track them separately so that they don't clobber each other.
-            // For example, if a log write happens within a function call, the log hook would clobber the function hook.
-            std::chrono::steady_clock::time_point log_hook_start;
-            std::chrono::steady_clock::time_point other_hook_start;
+            // The groups of metrics in Exporter::enabled_metrics.
+            enum MetricGroup
+            {
+                METRICS_FUNCTION_CALLS = 1 << 0,
+                METRICS_FUNCTION_TIMES = 1 << 1,
+                METRICS_PLUGIN_HOOKS = 1 << 2,
+                METRICS_LOG_WRITES = 1 << 3,
+                METRICS_PROCESS_CPU_TIME = 1 << 4,
+            };
 
-            // These are a stack to track children duration separately from parents.
-            std::stack<std::chrono::steady_clock::time_point> func_hook_starts;
+            uint32_t enabled_metrics = ~0u;
 
-            // The duration of our CallFunction hook is the duration of the hook itself + the duration of the function call. We track
-            // the function call durations here, so we can have an accurate duration of just the CallFunction hook.
-            std::stack<std::chrono::microseconds> func_durations;
+            // The families of the disabled groups. Asking for one of their counters gets discarded_counter, which
+            // is never published.
+            std::vector<const void*> disabled_families;
+            PendingCounter discarded_counter = {nullptr, 0.0, nullptr, 0, 0};
 
-            // The duration of our function call is the duration of the function itself (the "absolute" time) + the duration
-            // of any child functions called by the measured function. We keep track of those child function durations here,
-            // so we can have an accurate "absolute" duration of just the function call.
-            std::vector<double> child_func_durations;
+            // Where our timestamps come from, as selected by Exporter::timing_source.
+            Clock clock_source;
+
+            // With Exporter::sample_rate, we only time 1 in sample_rate top-level calls (along with everything they call),
+            // and scale the measured times up by sample_rate. The other calls are only counted, and Zeek invokes them itself.
+            uint64_t sample_rate = 1;
+            uint64_t sample_state = 0x9e3779b97f4a7c15;
+            bool time_call_tree = true;
+
+            // These are for measuring the runtimes of hooks. We track them separately so that they don't clobber each other.
+            // For example, if a log write happens within a function call, the log hook would clobber the function hook.
+            uint64_t log_hook_start = 0;
+            uint64_t other_hook_start = 0;
+
+            // The duration of our CallFunction hook is the duration of the hook itself + the duration of the function call,
+            // and the duration of our function call is the duration of the function itself (the "absolute" time) + the
+            // duration of any child functions called by the measured function. The first is tracked with
+            // invoked_duration, and the second in frames, so we can tell them apart.
 
             typedef std::tuple<int, int> offset_pair;
             // These events are those which we want to add more labels to, so we can track based on arguments.
@@ -76,10 +406,204 @@ namespace plugin {
             // The second int in the tuple is the offset in the var_list to store in the "addl" label.
             //
             // -1 offsets will not be stored.
-            std::map<std::string, offset_pair> arg_events;
+            //
+            // Updates build a new table, and swap it in, so that a change to Exporter::arg_functions applies all at once.
+            typedef std::map<std::string, offset_pair> ArgEventTable;
+            std::shared_ptr<const ArgEventTable> arg_events = std::make_shared<ArgEventTable>();
+            void SwapArgEvents(std::shared_ptr<const ArgEventTable> updated);
+
+            // Incremented whenever arg_events changes, so that the offsets cached in FuncMetrics get looked up again.
+            uint32_t arg_events_version = 1;
+
+            // Since arg and addl labels come from the traffic, a noisy network could create an unbounded number of series.
+            // We keep track of the values we've seen for each function's label, and once there are
+            // Exporter::arg_label_limit of them, any new values get folded into arg_label_overflow.
+            uint64_t arg_label_limit = 0;
+            const char* arg_label_overflow = "__other__";
+            static constexpr const char* arg_label_names[NUM_ARG_LABELS] = {"arg", "addl"};
+
+            // The values are interned, so that finding a call's counters doesn't build or copy any strings. They're
+            // only turned back into labels when the counters get symbolized.
+            enum { NO_ARG_VALUE = 0, OVERFLOW_ARG_VALUE = 1 };
+
+            struct ArgLabelValues
+            {
+                // By ID, starting with placeholders for the two above. It's a deque so that the views in ids stay put.
+                std::deque<std::string> values = {"", ""};
+                // How many arg_func_metrics entries have each value. Once none do, e.g. after Exporter::series_ttl
+                // evicts them, the ID goes on free_ids, to be reused by the next new value.
+                std::vector<uint32_t> refs = {0, 0};
+                std::vector<uint32_t> free_ids;
+                // The values under Exporter::arg_label_limit.
+                std::unordered_map<std::string_view, uint32_t> ids;
+                PendingCounter* dropped = nullptr;
+            };
+
+            std::map<std::pair<const zeek::Func*, ArgLabel>, ArgLabelValues> arg_label_values;
+
+            // Looking up a counter in a family means building a label map, hashing it, and taking the family's lock.
+            // Doing that several times for every function call adds up, so we do it once, and keep the pointers here.
+            //
+            // Note: Functions are keyed by pointer. Zeek keeps functions around for the lifetime of the process, with the
+            // exception of lambdas, whose address may get reused by a later lambda.
+            std::unordered_map<FuncCallerKey, FuncMetrics, FuncCallerKeyHash> func_metrics;
+
+            // The counters for calls with arg or addl labels, by function, caller and label value IDs. Only calls,
+            // cpu_time and absolute_cpu_time are set.
+            std::unordered_map<ArgFuncKey, FuncMetrics, ArgFuncKeyHash> arg_func_metrics;
+
+            // The FuncMetrics we haven't named yet. Until then, their counters aren't attached to the registry.
+            struct Unsymbolized
+            {
+                const zeek::Func* func;
+                uint32_t caller;
+                // Only set for arg_func_metrics.
+                const ArgFuncKey* arg_key;
+                FuncMetrics* metrics;
+                // Whether the duration histogram is new, and needs its labels too.
+                bool new_histogram;
+            };
+
+            std::vector<Unsymbolized> unsymbolized;
+            HookMetrics hook_metrics[zeek::plugin::NUM_HOOKS][NUM_HOOK_HANDLERS] = {};
+
+            // Keyed by the writer info and filter name. Both live as long as the log writer does, so their addresses
+            // identify it without having to build and hash labels for every log line.
+            std::unordered_map<std::pair<const void*, const void*>, LogMetrics, LogKeyHash> log_metrics;
+
+            // Whether we attribute the time spent in connection events to the connection's service
+            // (Exporter::service_costs), and the counters, by service.
+            bool service_costs = false;
+            std::unordered_map<std::string, PendingCounter*> service_counters;
+            PendingCounter* unknown_service_counter = nullptr;
+            // The last connection's service set, and what it resolved to. See ResolveServiceCounter().
+            zeek::ValPtr last_services;
+            int last_num_services = 0;
+            PendingCounter* last_service_counter = nullptr;
+
+            // With Exporter::exemplars, the FuncMetrics that have had a call since the last flush, and the exemplars we
+            // serve for zeek_cpu_time_per_function_seconds. An exemplar stays until it's replaced, or gets too old.
+            bool exemplars = false;
+            std::vector<FuncMetrics*> slowest_calls;
+            ExemplarMap function_exemplars;
+            static constexpr double exemplar_max_age = 300.0;
+
+            // With Exporter::event_queue_metrics, when the events for each handler which are waiting in the event queue
+            // were queued. The queue is FIFO, so we can match them up with the handlers' calls.
+            bool event_queue_metrics = false;
+            static constexpr size_t max_queued_per_handler = 65536;
+            std::unordered_map<const zeek::Func*, std::deque<uint64_t>> queued_events;
+            // The number of events queued since the last drain.
+            uint64_t events_since_drain = 0;
+            PendingHistogram* event_queue_latency = nullptr;
+            PendingHistogram* event_queue_depth = nullptr;
+
+            // Whether we estimate the size of log writes (Exporter::log_write_bytes), and for 1 in how many lines.
+            bool log_write_bytes = false;
+            uint64_t log_write_bytes_sample_rate = 1;
+
+            // Updating a counter in the registry is an atomic operation, and competes with the exposer thread for the
+            // cache line whenever a scrape comes in. Instead, the hot path adds to these plain values, which are only
+            // ever touched by the main thread, and FlushMetrics() hands them over to the registry periodically.
+            //
+            // This is a deque so that the pointers we hand out stay valid as it grows.
+            std::deque<PendingCounter> pending_counters;
+
+            // So that asking for the same counter twice gets the same PendingCounter.
+            std::unordered_map<prometheus::Counter*, PendingCounter*> buffered_counters;
+            std::deque<CounterSeries> counter_series;
+
+            // With Exporter::series_ttl, counters (and the cache entries holding them) that haven't been updated in
+            // series_ttl_flushes flushes get removed. Released PendingCounters are reused, with their CounterSeries.
+            //
+            // Several PendingCounters can be for the same counter, so counter_refs tracks how many are, and the counter
+            // is only removed once none are. On the manager, merged_series does the same for the series that get
+            // updated with other nodes' deltas, and removes the ones our own counters have let go of.
+            uint64_t series_ttl_flushes = 0;
+            uint64_t evict_every_flushes = 1;
+            uint64_t flush_count = 0;
+            std::vector<PendingCounter*> free_counters;
+            std::unordered_map<prometheus::Counter*, uint32_t> counter_refs;
+            std::unordered_map<prometheus::Counter*, std::pair<prometheus::Family<prometheus::Counter>*, uint64_t>> merged_series;
+
+            std::deque<PendingHistogram> pending_histograms;
+
+            // Whether we keep a duration histogram for each function (Exporter::function_histograms), and the histograms
+            // themselves, which are keyed by function only, to keep the number of series down.
+            bool function_histograms = false;
+            std::unordered_map<const zeek::Func*, PendingHistogram*> func_histograms;
+
+            // With Exporter::cluster_aggregation, the manager merges everyone's counters, and serves them from its own
+            // endpoint. Every other node doesn't expose its metrics, and ships its counters' increments to the manager
+            // instead. Histograms and gauges aren't shipped.
+            bool ship_deltas = false;
+            std::vector<CounterSeries*> unshipped_series;
+
+            // The counter families, indexed the same way on every node, which is how deltas refer to them.
+            std::vector<prometheus::Family<prometheus::Counter>*> counter_families;
+
+            // The CPU time of each thread, by name, which we gather when we flush.
+            struct ThreadCPUTime
+            {
+                prometheus::Gauge* gauge = nullptr;
+                double time = 0.0;
+            };
+
+            std::map<std::string, ThreadCPUTime> thread_cpu_times;
+
+            // Measuring a big table means visiting every element, so the globals are walked a few at a time, until
+            // memory_walk_budget microseconds have been spent in a sample, picking up after memory_walk_cursor. Once a
+            // walk gets through all of them, the memory_top_globals largest get published.
+            //
+            // A single table is measured all at once, so ones with more than memory_walk_max_elements elements are
+            // estimated instead, from their bytes per element the last time they were measured (global_element_bytes),
+            // or else from the average of the tables that were. Where Zeek can't measure tables at all, they're all
+            // estimated at typical_element_bytes per element.
+            static constexpr double typical_element_bytes = 128.0;
+            struct GlobalSize
+            {
+                std::string name;
+                uint64_t elements;
+                uint64_t bytes;
+                bool estimated;
+            };
+
+            struct GlobalGauges
+            {
+                prometheus::Gauge* elements;
+                prometheus::Gauge* bytes;
+            };
+
+            // The metrics for each of Zeek's message threads (log writers, input readers, ...), by thread name. These
+            // are gathered on every flush, see SampleMsgThreads().
+            struct MsgThreadMetrics
+            {
+                prometheus::Gauge* pending_in = nullptr;
+                prometheus::Gauge* pending_out = nullptr;
+                prometheus::Counter* messages_in = nullptr;
+                prometheus::Counter* messages_out = nullptr;
+                prometheus::Gauge* cpu_time = nullptr;
+                uint64_t sent_in = 0;
+                uint64_t sent_out = 0;
+                bool seen = false;
+            };
+
+            std::map<std::string, MsgThreadMetrics> msg_thread_metrics;
+
+            uint64_t memory_top_globals = 0;
+            double memory_walk_budget = 0.0;
+            uint64_t memory_walk_max_elements = 0;
+            std::map<std::string, double> global_element_bytes;
+            std::string memory_walk_cursor;
+            std::vector<GlobalSize> memory_walk_sizes;
+            std::map<std::string, GlobalGauges> global_gauges;
 
             // The data that we're exposing to Prometheus:
             std::shared_ptr<prometheus::Exposer> exposer;
+            // Used instead of the exposer if Exporter::exposition_mode is "snapshot". It's updated every time we flush.
+            std::shared_ptr<SnapshotServer> snapshot_server;
+            // Used instead of the exposer if Exporter::exposition_mode is "push".
+            std::shared_ptr<Pusher> pusher;
             std::shared_ptr<prometheus::Registry> registry = std::make_shared<prometheus::Registry>();
 
             // Counter family for the number of log lines in zeek_log_writes_total
@@ -89,6 +613,19 @@ namespace plugin {
                     .Labels({{"node", node_name}})
                     .Register(*registry);
 
+            // Estimated bytes and fields written per log, writer and filter. Only populated if Exporter::log_write_bytes is set.
+            prometheus::Family<prometheus::Counter>& zeek_log_write_bytes_total = prometheus::BuildCounter()
+                    .Name("zeek_log_write_bytes_total")
+                    .Help("An estimate of the number of bytes written per log, writer and filter, before any compression.")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
+            prometheus::Family<prometheus::Counter>& zeek_log_write_fields_total = prometheus::BuildCounter()
+                    .Name("zeek_log_write_fields_total")
+                    .Help("The number of fields written per log, writer and filter.")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
             // This family just tracks the start time of each plugin
             prometheus::Family<prometheus::Counter>& zeek_start_time_seconds = prometheus::BuildCounter()
                     .Name("zeek_start_time_seconds")
@@ -131,6 +668,34 @@ namespace plugin {
                     .Labels({{"node", node_name}})
                     .Register(*registry);
 
+            // The number of seconds spent in events about connections, by the connections' services.
+            prometheus::Family<prometheus::Counter>& zeek_cpu_time_per_service_seconds = prometheus::BuildCounter()
+                    .Name("zeek_cpu_time_per_service_seconds")
+                    .Help("The amount of time spent in Zeek events about connections, including the functions they call, by the connection's service. Measured in seconds.")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
+            // The distribution of function durations, by function type and name. Only populated if Exporter::function_histograms is set.
+            prometheus::Family<prometheus::Histogram>& zeek_function_duration_seconds = prometheus::BuildHistogram()
+                    .Name("zeek_function_duration_seconds")
+                    .Help("The distribution of time spent in each Zeek function call, including child functions. Measured in seconds.")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
+            // How long events waited in the event queue, and how many got dispatched per drain. Only populated if
+            // Exporter::event_queue_metrics is set.
+            prometheus::Family<prometheus::Histogram>& zeek_event_queue_latency_seconds = prometheus::BuildHistogram()
+                    .Name("zeek_event_queue_latency_seconds")
+                    .Help("The distribution of time events spent in the event queue, from being queued to being dispatched. Measured in seconds.")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
+            prometheus::Family<prometheus::Histogram>& zeek_event_queue_depth = prometheus::BuildHistogram()
+                    .Name("zeek_event_queue_depth")
+                    .Help("The distribution of the number of events queued between drains of the event queue, for drains with any events.")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
             // The seconds of CPU time consumed by the process as a whole.
             prometheus::Family<prometheus::Gauge>& zeek_total_cpu_time_seconds = prometheus::BuildGauge()
                     .Name("zeek_total_cpu_time_seconds")
@@ -138,6 +703,58 @@ namespace plugin {
                     .Labels({{"node", node_name}})
                     .Register(*registry);
 
+            // The seconds of CPU time consumed by each thread, by thread name.
+            prometheus::Family<prometheus::Gauge>& zeek_thread_cpu_time_seconds = prometheus::BuildGauge()
+                    .Name("zeek_thread_cpu_time_seconds")
+                    .Help("The amount of CPU time spent in each of this process' threads, by thread name")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
+            // The messages waiting in each message thread's queues. "in" is from the main thread to the thread, "out" is
+            // the other way around, so a slow log writer shows up as a growing "in" queue.
+            prometheus::Family<prometheus::Gauge>& zeek_msg_thread_queue_depth = prometheus::BuildGauge()
+                    .Name("zeek_msg_thread_queue_depth")
+                    .Help("The number of messages waiting in each of Zeek's message thread queues, by thread and direction")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
+            prometheus::Family<prometheus::Counter>& zeek_msg_thread_messages_total = prometheus::BuildCounter()
+                    .Name("zeek_msg_thread_messages_total")
+                    .Help("The number of messages sent through each of Zeek's message thread queues, by thread and direction")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
+            prometheus::Family<prometheus::Gauge>& zeek_msg_thread_cpu_time_seconds = prometheus::BuildGauge()
+                    .Name("zeek_msg_thread_cpu_time_seconds")
+                    .Help("The amount of CPU time spent in each of Zeek's message threads")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
+            // The process' memory use, from the kernel, and from Zeek's own accounting.
+            prometheus::Family<prometheus::Gauge>& zeek_memory_bytes = prometheus::BuildGauge()
+                    .Name("zeek_memory_bytes")
+                    .Help("The amount of memory used by this process, by type (rss, max_rss, or malloced). Measured in bytes.")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
+            // These are only added once we sample the memory, so they don't show up as 0 if we don't.
+            prometheus::Gauge* rss_gauge = nullptr;
+            prometheus::Gauge* max_rss_gauge = nullptr;
+            prometheus::Gauge* malloced_gauge = nullptr;
+
+            // The largest global tables and sets, as of the last complete walk through the globals.
+            prometheus::Family<prometheus::Gauge>& zeek_global_elements = prometheus::BuildGauge()
+                    .Name("zeek_global_elements")
+                    .Help("The number of elements in the largest global tables and sets")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
+            prometheus::Family<prometheus::Gauge>& zeek_global_bytes = prometheus::BuildGauge()
+                    .Name("zeek_global_bytes")
+                    .Help("The approximate amount of memory used by the largest global tables and sets. Measured in bytes.")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
             // The amount of time spent processing each plugin hook.
             prometheus::Family<prometheus::Counter>& zeek_hook_cpu_time_seconds = prometheus::BuildCounter()
                     .Name("zeek_hook_cpu_time_seconds")
@@ -145,6 +762,20 @@ namespace plugin {
                     .Labels({{"node", node_name}})
                     .Register(*registry);
 
+            // The number of arg and addl label values which were folded into the overflow series.
+            prometheus::Family<prometheus::Counter>& zeek_dropped_label_values_total = prometheus::BuildCounter()
+                    .Name("zeek_dropped_label_values_total")
+                    .Help("The number of times an arg or addl label value was replaced by __other__, because the function already had Exporter::arg_label_limit distinct values.")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
+            // The time our function call hook spends on its own bookkeeping, after the function returns.
+            prometheus::Family<prometheus::Counter>& zeek_plugin_overhead_seconds = prometheus::BuildCounter()
+                    .Name("zeek_plugin_overhead_seconds")
+                    .Help("The amount of time the exporter spends updating its own metrics after timed function calls. Measured in seconds.")
+                    .Labels({{"node", node_name}})
+                    .Register(*registry);
+
             // The number of times each plugin hook type was called.
             prometheus::Family<prometheus::Counter>& zeek_hooks_total = prometheus::BuildCounter()
                     .Name("zeek_hooks_total")
@@ -152,6 +783,12 @@ namespace plugin {
                     .Labels({{"node", node_name}})
                     .Register(*registry);
 
+            // Resolved once, since we update it for every event with arguments.
+            PendingCounter* addl_arg_hook_cpu_time_seconds = nullptr;
+            PendingCounter* self_overhead_seconds = nullptr;
+
+            prometheus::Gauge& cpu_time_gauge = zeek_total_cpu_time_seconds.Add({{"type", "cpu_time"}});
+
         };
 
         extern Plugin plugin;
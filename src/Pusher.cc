@@ -0,0 +1,185 @@
+#include <chrono>
+#include <iterator>
+#include <stdexcept>
+
+#ifdef HAVE_CURL
+#include <curl/curl.h>
+#endif
+
+#include <prometheus/text_serializer.h>
+
+#include "Pusher.h"
+
+using namespace plugin::ESnet_Zeek_Exporter;
+
+#ifdef HAVE_CURL
+static std::string Escape(CURL* curl, const std::string& s)
+{
+    char* escaped = curl_easy_escape(curl, s.c_str(), s.size());
+    std::string result = escaped ? escaped : "";
+    curl_free(escaped);
+    return result;
+}
+#endif
+
+Pusher::Pusher(const std::string& arg_url, const std::string& job, const std::string& instance, double arg_interval)
+    : interval(arg_interval)
+{
+#ifdef HAVE_CURL
+    // This isn't thread-safe, but we're constructed on the main thread, before anyone else uses curl.
+    if ( curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK )
+        throw std::runtime_error("couldn't initialize libcurl");
+
+    CURL* curl = curl_easy_init();
+    if ( ! curl )
+        throw std::runtime_error("couldn't initialize libcurl");
+
+    url = arg_url;
+    while ( ! url.empty() && url.back() == '/' )
+        url.pop_back();
+    url += "/metrics/job/" + Escape(curl, job) + "/instance/" + Escape(curl, instance);
+    curl_easy_cleanup(curl);
+
+    pusher_thread = std::thread(&Pusher::Run, this);
+#else
+    throw std::runtime_error("built without libcurl");
+#endif
+}
+
+Pusher::~Pusher()
+{
+    Stop();
+}
+
+void Pusher::RegisterCollectable(const std::weak_ptr<prometheus::Collectable>& collectable)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    collectables.push_back(collectable);
+}
+
+void Pusher::Stop()
+{
+    if ( ! pusher_thread.joinable() )
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stop_requested.notify_one();
+    pusher_thread.join();
+}
+
+bool Pusher::TakeError(std::string& error)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if ( ! error_pending )
+        return false;
+
+    error = last_error;
+    error_pending = false;
+    return true;
+}
+
+void Pusher::Run()
+{
+    auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval));
+    auto next_push = std::chrono::steady_clock::now() + period;
+
+    while ( true )
+    {
+        bool last_push;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop_requested.wait_until(lock, next_push, [this] { return stopping; });
+            last_push = stopping;
+        }
+
+        next_push += period;
+
+        std::string error;
+        bool ok = Push(error);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if ( ! ok && ! failing )
+            {
+                last_error = error;
+                error_pending = true;
+            }
+            failing = ! ok;
+        }
+
+        if ( last_push )
+            return;
+    }
+}
+
+bool Pusher::Push(std::string& error)
+{
+#ifdef HAVE_CURL
+    std::vector<std::weak_ptr<prometheus::Collectable>> to_collect;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        to_collect = collectables;
+    }
+
+    std::vector<prometheus::MetricFamily> metrics;
+    for ( auto& weak : to_collect )
+    {
+        auto collectable = weak.lock();
+        if ( ! collectable )
+            continue;
+
+        auto collected = collectable->Collect();
+        metrics.insert(metrics.end(), std::make_move_iterator(collected.begin()), std::make_move_iterator(collected.end()));
+    }
+
+    std::string body = prometheus::TextSerializer().Serialize(metrics);
+
+    CURL* curl = curl_easy_init();
+    if ( ! curl )
+    {
+        error = "couldn't initialize libcurl";
+        return false;
+    }
+
+    struct curl_slist* headers = curl_slist_append(nullptr, "Content-Type: text/plain; version=0.0.4; charset=utf-8");
+
+    // PUT replaces all of the metrics in our group, so series we no longer have don't linger on the gateway.
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.data());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) body.size());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    // Don't let a slow gateway delay the next push, or shutdown.
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+
+    CURLcode status = curl_easy_perform(curl);
+    long response_code = 0;
+    if ( status == CURLE_OK )
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+
+    if ( status != CURLE_OK )
+    {
+        error = curl_easy_strerror(status);
+        return false;
+    }
+
+    if ( response_code < 200 || response_code >= 300 )
+    {
+        error = "HTTP status " + std::to_string(response_code);
+        return false;
+    }
+
+    return true;
+#else
+    error = "built without libcurl";
+    return false;
+#endif
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <prometheus/collectable.h>
+
+namespace plugin {
+    namespace ESnet_Zeek_Exporter {
+
+        // Used instead of an exposer, for nodes that Prometheus can't reach. A background thread serializes the
+        // collectables every interval, and PUTs them to a Pushgateway, under /metrics/job/<job>/instance/<instance>.
+        //
+        // Counters are pushed as running totals, since the Pushgateway replaces the whole group on every push.
+        class Pusher
+        {
+        public:
+            // Throws std::runtime_error if we can't push (i.e. we were built without libcurl).
+            Pusher(const std::string& url, const std::string& job, const std::string& instance, double interval);
+            ~Pusher();
+
+            void RegisterCollectable(const std::weak_ptr<prometheus::Collectable>& collectable);
+
+            // Pushes one last time, and stops the background thread.
+            void Stop();
+
+            // If pushing started failing since we last checked, returns true, and sets error to the reason. This is
+            // here so that the main thread can report the problem, once, rather than for every failed push.
+            bool TakeError(std::string& error);
+
+        private:
+            void Run();
+            bool Push(std::string& error);
+
+            std::string url;
+            double interval;
+
+            std::thread pusher_thread;
+
+            std::mutex mutex;
+            std::condition_variable stop_requested;
+            bool stopping = false;
+            std::vector<std::weak_ptr<prometheus::Collectable>> collectables;
+
+            bool failing = false;
+            bool error_pending = false;
+            std::string last_error;
+        };
+
+    }
+}
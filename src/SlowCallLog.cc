@@ -0,0 +1,82 @@
+#include <cstdio>
+
+#include "SlowCallLog.h"
+
+using namespace plugin::ESnet_Zeek_Exporter;
+
+static void AppendJSONString(std::string& out, const std::string& value)
+{
+    out += '"';
+    for ( unsigned char c : value )
+    {
+        if ( c == '"' || c == '\\' )
+        {
+            out += '\\';
+            out += c;
+        }
+        else if ( c < 0x20 )
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else
+            out += c;
+    }
+    out += '"';
+}
+
+static void AppendNumber(std::string& out, double value)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6f", value);
+    out += buf;
+}
+
+std::string SlowCallLog::ToJSON(const std::vector<std::string>& func_names) const
+{
+    std::string out = "[";
+    const char* separator = "";
+
+    ForEach([&](const Entry& entry) {
+        out += separator;
+        out += "{\"name\":";
+        AppendJSONString(out, func_names[entry.func_id]);
+        out += ",\"caller\":";
+        AppendJSONString(out, func_names[entry.caller_id]);
+        out += ",\"depth\":" + std::to_string(entry.depth);
+        out += ",\"duration_seconds\":";
+        AppendNumber(out, entry.duration / 1000000.0);
+        out += ",\"network_time\":";
+        AppendNumber(out, entry.network_time);
+        out += "}";
+        separator = ",";
+    });
+
+    out += "]\n";
+    return out;
+}
+
+std::string SlowCallLog::ToChromeTrace(const std::vector<std::string>& func_names) const
+{
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    const char* separator = "";
+
+    ForEach([&](const Entry& entry) {
+        // Timestamps and durations are in microseconds.
+        out += separator;
+        out += "{\"name\":";
+        AppendJSONString(out, func_names[entry.func_id]);
+        out += ",\"cat\":\"zeek\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":";
+        AppendNumber(out, entry.network_time * 1000000.0);
+        out += ",\"dur\":";
+        AppendNumber(out, entry.duration);
+        out += ",\"args\":{\"caller\":";
+        AppendJSONString(out, func_names[entry.caller_id]);
+        out += ",\"depth\":" + std::to_string(entry.depth) + "}}";
+        separator = ",";
+    });
+
+    out += "]}\n";
+    return out;
+}
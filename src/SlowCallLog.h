@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace plugin {
+    namespace ESnet_Zeek_Exporter {
+
+        // The last calls that took longer than Exporter::slow_call_threshold, in a fixed size ring, so that a single
+        // pathological call can be looked at after the fact. Once the ring is full, each call overwrites the oldest.
+        //
+        // This is only ever used from the main thread, so it doesn't need a lock: the server gets a copy, rendered as
+        // JSON, at the next flush.
+        class SlowCallLog
+        {
+        public:
+            struct Entry
+            {
+                // IDs in the plugin's func_names.
+                uint32_t func_id;
+                uint32_t caller_id;
+                // 1 for calls at the top level, e.g. events dispatched from the event queue.
+                uint32_t depth;
+                // In microseconds.
+                double duration;
+                double network_time;
+            };
+
+            void SetCapacity(size_t capacity)
+            {
+                entries.resize(capacity);
+            }
+
+            bool Enabled() const
+            {
+                return ! entries.empty();
+            }
+
+            void Record(const Entry& entry)
+            {
+                entries[recorded % entries.size()] = entry;
+                recorded++;
+            }
+
+            // How many calls have been recorded, including the ones which have been overwritten.
+            uint64_t Recorded() const
+            {
+                return recorded;
+            }
+
+            // The entries, oldest first, as a JSON array of objects.
+            std::string ToJSON(const std::vector<std::string>& func_names) const;
+
+            // The entries in the Chrome trace event format, for chrome://tracing or Perfetto. Each call is a complete
+            // event, at its network time, so nested slow calls show up inside their callers.
+            std::string ToChromeTrace(const std::vector<std::string>& func_names) const;
+
+        private:
+            // Calls fn with each entry, oldest first.
+            template<typename Fn>
+            void ForEach(Fn fn) const
+            {
+                size_t count = recorded < entries.size() ? recorded : entries.size();
+                for ( uint64_t i = recorded - count; i < recorded; ++i )
+                    fn(entries[i % entries.size()]);
+            }
+
+            std::vector<Entry> entries;
+            uint64_t recorded = 0;
+        };
+
+    }
+}
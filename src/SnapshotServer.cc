@@ -0,0 +1,397 @@
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <prometheus/text_serializer.h>
+
+#include "SnapshotServer.h"
+
+using namespace plugin::ESnet_Zeek_Exporter;
+
+static std::string Compress(const std::string& body)
+{
+#ifdef HAVE_ZLIB
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    // 15 + 16 gives us a gzip header, rather than a raw zlib stream.
+    if ( deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK )
+        return "";
+
+    std::string compressed;
+    compressed.resize(deflateBound(&stream, body.size()));
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(body.data()));
+    stream.avail_in = body.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+    stream.avail_out = compressed.size();
+
+    int status = deflate(&stream, Z_FINISH);
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    return status == Z_STREAM_END ? compressed : "";
+#else
+    return "";
+#endif
+}
+
+// Waits until fd is ready for events, or the deadline passes.
+static bool WaitUntil(int fd, short events, std::chrono::steady_clock::time_point deadline)
+{
+    while ( true )
+    {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if ( remaining.count() <= 0 )
+            return false;
+
+        struct pollfd pfd = {fd, events, 0};
+        int ready = poll(&pfd, 1, remaining.count());
+        if ( ready < 0 && errno == EINTR )
+            continue;
+
+        return ready > 0;
+    }
+}
+
+static void SendAll(int fd, const char* data, size_t len, std::chrono::steady_clock::time_point deadline)
+{
+    while ( len )
+    {
+        if ( ! WaitUntil(fd, POLLOUT, deadline) )
+            return;
+
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if ( sent < 0 && ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) )
+            continue;
+        if ( sent <= 0 )
+            return;
+
+        data += sent;
+        len -= sent;
+    }
+}
+
+// The value of the request header name (which is lowercase), or an empty string.
+static std::string HeaderValue(const std::string& request, const char* name)
+{
+    size_t name_len = strlen(name);
+
+    // Skip the request line.
+    for ( size_t line = request.find("\r\n"); line != std::string::npos; line = request.find("\r\n", line) )
+    {
+        line += 2;
+        size_t colon = request.find(':', line);
+        size_t end = request.find("\r\n", line);
+        if ( end == line || end == std::string::npos )
+            break;
+
+        if ( colon == std::string::npos || colon > end || colon - line != name_len )
+            continue;
+
+        bool match = true;
+        for ( size_t i = 0; i < name_len && match; ++i )
+            match = std::tolower(static_cast<unsigned char>(request[line + i])) == name[i];
+
+        if ( ! match )
+            continue;
+
+        size_t value = request.find_first_not_of(" \t", colon + 1);
+        return value < end ? request.substr(value, end - value) : "";
+    }
+
+    return "";
+}
+
+// Whether a header like Accept or Accept-Encoding lists token (which is lowercase), without q=0.
+static bool HeaderAccepts(const std::string& value, const char* token)
+{
+    size_t token_len = strlen(token);
+    size_t start = 0;
+
+    while ( start < value.size() )
+    {
+        size_t end = value.find(',', start);
+        if ( end == std::string::npos )
+            end = value.size();
+
+        std::string item = value.substr(start, end - start);
+        start = end + 1;
+
+        size_t first = item.find_first_not_of(" \t");
+        if ( first == std::string::npos )
+            continue;
+
+        size_t params = item.find(';', first);
+        size_t last = item.find_last_not_of(" \t", params == std::string::npos ? std::string::npos : params - 1);
+        if ( last == std::string::npos || last + 1 - first != token_len )
+            continue;
+
+        bool match = true;
+        for ( size_t i = 0; i < token_len && match; ++i )
+            match = std::tolower(static_cast<unsigned char>(item[first + i])) == token[i];
+
+        if ( ! match )
+            continue;
+
+        size_t q = params == std::string::npos ? std::string::npos : item.find("q=", params);
+        return q == std::string::npos || strtod(item.c_str() + q + 2, nullptr) > 0;
+    }
+
+    return false;
+}
+
+SnapshotServer::SnapshotServer(const std::string& address, uint32_t port, bool arg_gzip) : gzip(arg_gzip)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+
+    struct addrinfo* res;
+    if ( getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &res) != 0 )
+        throw std::runtime_error("invalid bind address");
+
+    listen_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int on = 1;
+    if ( listen_fd < 0 ||
+         setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+         bind(listen_fd, res->ai_addr, res->ai_addrlen) < 0 ||
+         listen(listen_fd, 16) < 0 )
+    {
+        freeaddrinfo(res);
+        if ( listen_fd >= 0 )
+            close(listen_fd);
+        throw std::runtime_error(strerror(errno));
+    }
+
+    freeaddrinfo(res);
+
+    server_thread = std::thread(&SnapshotServer::Serve, this);
+    serializer_thread = std::thread(&SnapshotServer::Serialize, this);
+}
+
+SnapshotServer::~SnapshotServer()
+{
+    {
+        std::lock_guard<std::mutex> lock(collectables_mutex);
+        stopping = true;
+    }
+    update_requested.notify_one();
+
+    serializer_thread.join();
+    server_thread.join();
+    close(listen_fd);
+}
+
+void SnapshotServer::RegisterCollectable(const std::weak_ptr<prometheus::Collectable>& collectable)
+{
+    std::lock_guard<std::mutex> lock(collectables_mutex);
+    collectables.push_back(collectable);
+}
+
+void SnapshotServer::RequestUpdate()
+{
+    {
+        std::lock_guard<std::mutex> lock(collectables_mutex);
+        update_pending = true;
+    }
+    update_requested.notify_one();
+}
+
+std::shared_ptr<const SnapshotServer::Document> SnapshotServer::MakeDocument(const std::string& content_type, std::string body) const
+{
+    auto document = std::make_shared<Document>();
+    document->content_type = content_type;
+    if ( gzip )
+        document->gzipped = Compress(body);
+    document->body = std::move(body);
+    return document;
+}
+
+void SnapshotServer::Publish(const std::string& path, const std::string& content_type, std::string body)
+{
+    {
+        std::lock_guard<std::mutex> lock(collectables_mutex);
+        pending_documents[path] = {content_type, std::move(body)};
+    }
+    update_requested.notify_one();
+}
+
+void SnapshotServer::Install(const std::string& path, const std::string& content_type, std::string body)
+{
+    auto document = MakeDocument(content_type, std::move(body));
+
+    std::lock_guard<std::mutex> lock(documents_mutex);
+    documents[path] = std::move(document);
+}
+
+void SnapshotServer::SetExemplars(std::shared_ptr<const ExemplarMap> arg_exemplars)
+{
+    std::lock_guard<std::mutex> lock(exemplars_mutex);
+    exemplars = std::move(arg_exemplars);
+}
+
+void SnapshotServer::Serialize()
+{
+    prometheus::TextSerializer serializer;
+    OpenMetricsSerializer openmetrics_serializer;
+
+    while ( true )
+    {
+        std::vector<std::weak_ptr<prometheus::Collectable>> to_collect;
+        std::map<std::string, std::pair<std::string, std::string>> to_install;
+        bool update = false;
+
+        {
+            std::unique_lock<std::mutex> lock(collectables_mutex);
+            update_requested.wait(lock, [this] { return update_pending || ! pending_documents.empty() || stopping; });
+            if ( stopping )
+                return;
+
+            update = update_pending;
+            update_pending = false;
+            to_install.swap(pending_documents);
+            if ( update )
+                to_collect = collectables;
+        }
+
+        // Published documents only get compressed here, off the main thread.
+        for ( auto& pending : to_install )
+            Install(pending.first, pending.second.first, std::move(pending.second.second));
+
+        if ( ! update )
+            continue;
+
+        // This is the expensive part, so we do it without holding the lock, to keep RequestUpdate() from blocking.
+        std::vector<prometheus::MetricFamily> metrics;
+        for ( auto& weak : to_collect )
+        {
+            auto collectable = weak.lock();
+            if ( ! collectable )
+                continue;
+
+            auto collected = collectable->Collect();
+            metrics.insert(metrics.end(), std::make_move_iterator(collected.begin()), std::make_move_iterator(collected.end()));
+        }
+
+        std::shared_ptr<const ExemplarMap> current_exemplars;
+        {
+            std::lock_guard<std::mutex> lock(exemplars_mutex);
+            current_exemplars = exemplars;
+        }
+
+        if ( current_exemplars )
+        {
+            auto document = MakeDocument(OpenMetricsSerializer::content_type,
+                                         openmetrics_serializer.Serialize(metrics, current_exemplars.get()));
+
+            std::lock_guard<std::mutex> lock(documents_mutex);
+            openmetrics_document = std::move(document);
+        }
+
+        Install("/metrics", "text/plain; version=0.0.4; charset=utf-8", serializer.Serialize(metrics));
+    }
+}
+
+void SnapshotServer::Serve()
+{
+    while ( ! stopping )
+    {
+        // Wake up regularly, so we notice when we're shutting down.
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        if ( poll(&pfd, 1, 250) <= 0 )
+            continue;
+
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if ( fd < 0 )
+            continue;
+
+        HandleConnection(fd);
+        close(fd);
+    }
+}
+
+void SnapshotServer::HandleConnection(int fd)
+{
+    // We only serve one connection at a time, so a slow client gets a fixed amount of time for its whole request and
+    // response, however it trickles them, rather than a timeout per read.
+    auto deadline = std::chrono::steady_clock::now() + connection_timeout;
+
+    // We only need the request line and headers.
+    std::string request;
+    char buf[1024];
+    while ( request.find("\r\n\r\n") == std::string::npos && request.size() < 8192 )
+    {
+        if ( ! WaitUntil(fd, POLLIN, deadline) )
+            return;
+
+        ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if ( len < 0 && ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) )
+            continue;
+        if ( len <= 0 )
+            return;
+
+        request.append(buf, len);
+    }
+
+    // GET <path> HTTP/1.x
+    size_t path_start = request.find(' ');
+    size_t path_end = path_start == std::string::npos ? std::string::npos : request.find_first_of(" ?\r\n", path_start + 1);
+    if ( request.compare(0, 4, "GET ") != 0 || path_end == std::string::npos )
+    {
+        const char* response = "HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        SendAll(fd, response, strlen(response), deadline);
+        return;
+    }
+
+    std::string path = request.substr(path_start + 1, path_end - path_start - 1);
+
+    bool accepts_openmetrics = HeaderAccepts(HeaderValue(request, "accept"), "application/openmetrics-text");
+
+    std::shared_ptr<const Document> document;
+    {
+        std::lock_guard<std::mutex> lock(documents_mutex);
+        if ( path == "/metrics" && accepts_openmetrics && openmetrics_document )
+            document = openmetrics_document;
+        else
+        {
+            auto it = documents.find(path);
+            if ( it != documents.end() )
+                document = it->second;
+        }
+    }
+
+    if ( ! document )
+    {
+        const char* response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        SendAll(fd, response, strlen(response), deadline);
+        return;
+    }
+
+    bool accepts_gzip = HeaderAccepts(HeaderValue(request, "accept-encoding"), "gzip");
+    bool compressed = accepts_gzip && ! document->gzipped.empty();
+    const std::string& body = compressed ? document->gzipped : document->body;
+
+    std::string headers = "HTTP/1.0 200 OK\r\nContent-Type: " + document->content_type + "\r\n";
+    if ( compressed )
+        headers += "Content-Encoding: gzip\r\n";
+    headers += "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+
+    SendAll(fd, headers.data(), headers.size(), deadline);
+    SendAll(fd, body.data(), body.size(), deadline);
+}
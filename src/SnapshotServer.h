@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <prometheus/collectable.h>
+
+#include "OpenMetricsSerializer.h"
+
+namespace plugin {
+    namespace ESnet_Zeek_Exporter {
+
+        // An alternative to prometheus::Exposer. Rather than walking and serializing the registry on every scrape, a
+        // background thread serializes it into a snapshot whenever RequestUpdate() is called, and scrapes are answered
+        // straight from the latest snapshot. Scrapes thus cost the same regardless of the number of series, and never
+        // hold the families' locks. Other pre-rendered documents can be served next to /metrics with Publish().
+        //
+        // Once SetExemplars() has been called, /metrics is also rendered in the OpenMetrics format, with the exemplars,
+        // for scrapers that ask for it.
+        //
+        // This only speaks enough HTTP/1.0 to answer GET requests, one connection at a time, each of which gets
+        // connection_timeout to finish.
+        class SnapshotServer
+        {
+        public:
+            // Throws std::runtime_error if we can't bind.
+            SnapshotServer(const std::string& address, uint32_t port, bool gzip);
+            ~SnapshotServer();
+
+            // The collectables which get serialized into /metrics.
+            void RegisterCollectable(const std::weak_ptr<prometheus::Collectable>& collectable);
+
+            // Asks the serializer thread to take a new snapshot of the collectables. This doesn't block.
+            void RequestUpdate();
+
+            // Replaces the document served at path. The serializer thread compresses it, so this doesn't block
+            // either, and the old document is served until it's done.
+            void Publish(const std::string& path, const std::string& content_type, std::string body);
+
+            // Replaces the exemplars attached to the OpenMetrics rendering of the next snapshot.
+            void SetExemplars(std::shared_ptr<const ExemplarMap> exemplars);
+
+        private:
+            struct Document
+            {
+                std::string content_type;
+                std::string body;
+                // Empty if we're not compressing.
+                std::string gzipped;
+            };
+
+            std::shared_ptr<const Document> MakeDocument(const std::string& content_type, std::string body) const;
+            void Install(const std::string& path, const std::string& content_type, std::string body);
+            void Serialize();
+            void Serve();
+            void HandleConnection(int fd);
+
+            // How long a client gets to send its request and read our response.
+            static constexpr std::chrono::seconds connection_timeout{2};
+
+            int listen_fd = -1;
+            bool gzip;
+            std::atomic<bool> stopping{false};
+
+            std::thread server_thread;
+            std::thread serializer_thread;
+
+            // Also guards the documents that were published, but haven't been compressed yet, by path.
+            std::mutex collectables_mutex;
+            std::condition_variable update_requested;
+            bool update_pending = false;
+            std::vector<std::weak_ptr<prometheus::Collectable>> collectables;
+            std::map<std::string, std::pair<std::string, std::string>> pending_documents;
+
+            // Publishing swaps in a new document, so the server can keep sending the old one without holding the lock.
+            std::mutex documents_mutex;
+            std::map<std::string, std::shared_ptr<const Document>> documents;
+            // /metrics, for scrapers that accept application/openmetrics-text. Null until we have exemplars.
+            std::shared_ptr<const Document> openmetrics_document;
+
+            std::mutex exemplars_mutex;
+            std::shared_ptr<const ExemplarMap> exemplars;
+        };
+
+    }
+}